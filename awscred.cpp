@@ -16,35 +16,231 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <chrono>
+
+#include <aws/core/config/AWSProfileConfigLoader.h>
+#include <aws/core/client/ClientConfiguration.h>
+#include <aws/core/http/HttpClientFactory.h>
+#include <aws/core/http/HttpRequest.h>
+#include <aws/core/http/HttpResponse.h>
+#include <aws/core/internal/AWSHttpResourceClient.h>
+#include <aws/core/platform/FileSystem.h>
+#include <aws/core/utils/HashingUtils.h>
+#include <aws/core/utils/StringUtils.h>
+#include <aws/core/utils/json/JsonSerializer.h>
+#include <aws/core/utils/xml/XmlSerializer.h>
+#include <aws/core/auth/signer/AWSAuthV4Signer.h>
+
 #include "awscred.h"
+#include "awscred_probe.h"
 
 //----------------------------------------------------------
 // Variables
 //----------------------------------------------------------
+// [NOTE]
+// The symbols for each provider are defined only if the provider is
+// built, so that a subset build has no unused variables.
+//
+static const char S3fsDefaultCredentialsProviderChainTag[]			= "DefaultAWSCredentialsProviderChain";
+
+static const long    S3FS_DEADLINE_MAX_CONNECT_TIMEOUT_MS			= 1000;				// Connect timeout upper limit with deadline
+static const int64_t S3FS_MIN_RELOAD_INTERVAL_MS					= 10 * 1000;		// Do not reload valid credentials again within this
+
+#ifdef S3FSAWSCRED_PROVIDER_IMDS
+static const char S3FS_AWS_EC2_METADATA_DISABLED[]					= "AWS_EC2_METADATA_DISABLED";
+#endif
+
+#ifdef S3FSAWSCRED_PROVIDER_CONTAINER
 static const char S3FS_AWS_ECS_CONTAINER_CREDENTIALS_RELATIVE_URI[]	= "AWS_CONTAINER_CREDENTIALS_RELATIVE_URI";
 static const char S3FS_AWS_ECS_CONTAINER_CREDENTIALS_FULL_URI[]		= "AWS_CONTAINER_CREDENTIALS_FULL_URI";
 static const char S3FS_AWS_ECS_CONTAINER_AUTHORIZATION_TOKEN[]		= "AWS_CONTAINER_AUTHORIZATION_TOKEN";
-static const char S3FS_AWS_EC2_METADATA_DISABLED[]					= "AWS_EC2_METADATA_DISABLED";
-static const char S3fsDefaultCredentialsProviderChainTag[]			= "DefaultAWSCredentialsProviderChain";
+static const char S3FS_AWS_ECS_CONTAINER_AUTHORIZATION_TOKEN_FILE[]	= "AWS_CONTAINER_AUTHORIZATION_TOKEN_FILE";
+static const char S3FS_AWS_ECS_CONTAINER_ENDPOINT[]					= "http://169.254.170.2";
+static const char S3fsContainerCredentialsProviderTag[]				= "S3fsContainerCredentialsProvider";
+
+static const int64_t S3FS_CONTAINER_CREDENTIALS_REFRESH_MARGIN_MS	= 5 * 60 * 1000;	// Get container credentials 5 minutes before they expire
+static const int64_t S3FS_CONTAINER_CREDENTIALS_DEFAULT_PERIOD_MS	= 15 * 60 * 1000;	// Expiration of container credentials without Expiration
+#endif
+
+#ifdef S3FSAWSCRED_PROVIDER_SSO
+static const char S3fsSSOCredentialsProviderTag[]					= "S3fsSSOCredentialsProvider";
+static const char S3FS_SSO_BEARER_TOKEN_HEADER[]					= "x-amz-sso_bearer_token";
+
+static const int64_t S3FS_SSO_TOKEN_REFRESH_MARGIN_MS				= 5 * 60 * 1000;	// Refresh access token 5 minutes before it expires
+static const int64_t S3FS_SSO_CREDENTIALS_REFRESH_MARGIN_MS			= 5 * 60 * 1000;	// Get role credentials 5 minutes before they expire
+#endif
+
+#ifdef S3FSAWSCRED_PROVIDER_STS
+static const char S3fsSTSCredentialsProviderTag[]					= "S3fsSTSCredentialsProvider";
+static const char S3FS_AWS_ROLE_ARN[]								= "AWS_ROLE_ARN";
+static const char S3FS_AWS_WEB_IDENTITY_TOKEN_FILE[]				= "AWS_WEB_IDENTITY_TOKEN_FILE";
+static const char S3FS_AWS_ROLE_SESSION_NAME[]						= "AWS_ROLE_SESSION_NAME";
+static const char S3FS_AWS_REGION[]									= "AWS_REGION";
+static const char S3FS_AWS_DEFAULT_REGION[]							= "AWS_DEFAULT_REGION";
+static const char S3FS_STS_DEFAULT_REGION[]							= "us-east-1";
+
+static const int64_t S3FS_STS_CREDENTIALS_REFRESH_MARGIN_MS			= 5 * 60 * 1000;	// AssumeRole 5 minutes before credentials expire
+static const long    S3FS_STS_CONNECT_TIMEOUT_MS					= 1000;				// Short timeouts for failing over to the next endpoint
+static const long    S3FS_STS_REQUEST_TIMEOUT_MS					= 3000;
+static const double  S3FS_STS_EWMA_ALPHA							= 0.2;				// Weight of the latest sample in moving averages
+static const double  S3FS_STS_UNHEALTHY_ERROR_RATE					= 0.5;				// Endpoint is unhealthy above this error rate
+static const int64_t S3FS_STS_RETRY_UNHEALTHY_MS					= 30 * 1000;		// Try unhealthy endpoint again after this
+#endif
+
+//----------------------------------------------------------
+// Clock utilities
+//----------------------------------------------------------
+static std::atomic<S3fsClockFunc>	virtualClock(nullptr);
+
+void S3fsSetVirtualClock(S3fsClockFunc clockfunc)
+{
+	virtualClock.store(clockfunc);
+}
+
+int64_t S3fsGetCurrentTimeMs()
+{
+	S3fsClockFunc	clockfunc = virtualClock.load(std::memory_order_relaxed);
+	if(clockfunc){
+		return clockfunc();
+	}
+	return Aws::Utils::DateTime::CurrentTimeMillis();
+}
+
+int64_t S3fsGetMonotonicMs()
+{
+	S3fsClockFunc	clockfunc = virtualClock.load(std::memory_order_relaxed);
+	if(clockfunc){
+		return clockfunc();
+	}
+
+	struct timespec	ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (static_cast<int64_t>(ts.tv_sec) * 1000 + static_cast<int64_t>(ts.tv_nsec) / (1000 * 1000));
+}
+
+//
+// Returns true if the credentials expire within marginms.
+// (Same as AWSCredentials::ExpiresSoon, but uses the clock above)
+//
+bool S3fsIsExpiredWithin(const Aws::Auth::AWSCredentials& credentials, int64_t marginms)
+{
+	return ((credentials.GetExpiration().Millis() - S3fsGetCurrentTimeMs()) <= marginms);
+}
+
+//----------------------------------------------------------
+// Methods : S3fsValidPeriod
+//----------------------------------------------------------
+Aws::Utils::DateTime S3fsValidPeriod::GetExpiration(int64_t periodsec, const Aws::String& sessionToken, const Aws::Utils::DateTime& exp)
+{
+	int64_t	nowmono = S3fsGetMonotonicMs();
+	if(targetSessionToken != sessionToken){
+		// Update new session token
+		int64_t	remainingms		= exp.Millis() - S3fsGetCurrentTimeMs();
+		targetExpirationMono	= nowmono + std::min(remainingms, (periodsec * 1000));
+		targetSessionToken		= sessionToken;
+	}
+	return Aws::Utils::DateTime(S3fsGetCurrentTimeMs() + (targetExpirationMono - nowmono));
+}
+
+//----------------------------------------------------------
+// Deadline utilities
+//----------------------------------------------------------
+//
+// Returns the remaining milliseconds until the deadline.
+// If there is no deadline, returns -1. If it has passed, returns 0.
+//
+int64_t S3fsGetRemainingMs(int64_t deadline)
+{
+	if(0 == deadline){
+		return -1;
+	}
+	int64_t	remaining = deadline - S3fsGetMonotonicMs();
+	return (0 < remaining ? remaining : 0);
+}
+
+//
+// Create a client configuration whose timeouts and retry strategy
+// are limited by the remaining time until the deadline.
+//
+Aws::Client::ClientConfiguration S3fsCreateClientConfiguration(int64_t deadline)
+{
+	Aws::Client::ClientConfiguration	config;
+
+	int64_t	remaining = S3fsGetRemainingMs(deadline);
+	if(-1 != remaining){
+		long	timeout				= static_cast<long>(std::max<int64_t>(1, remaining));
+		config.connectTimeoutMs		= std::min(timeout, S3FS_DEADLINE_MAX_CONNECT_TIMEOUT_MS);
+		config.requestTimeoutMs		= timeout;
+		config.httpRequestTimeoutMs	= timeout;
+		config.retryStrategy		= Aws::MakeShared<S3fsDeadlineRetryStrategy>(S3fsDefaultCredentialsProviderChainTag, deadline);
+	}
+	return config;
+}
+
+//----------------------------------------------------------
+// Methods : S3fsDeadlineRetryStrategy
+//----------------------------------------------------------
+S3fsDeadlineRetryStrategy::S3fsDeadlineRetryStrategy(int64_t deadlinems, long maxRetries) : Aws::Client::DefaultRetryStrategy(maxRetries), deadline(deadlinems)
+{
+}
+
+bool S3fsDeadlineRetryStrategy::ShouldRetry(const Aws::Client::AWSError<Aws::Client::CoreErrors>& error, long attemptedRetries) const
+{
+	int64_t	remaining = S3fsGetRemainingMs(deadline);
+	if(-1 != remaining && remaining <= CalculateDelayBeforeNextRetry(error, attemptedRetries)){
+		return false;
+	}
+	return Aws::Client::DefaultRetryStrategy::ShouldRetry(error, attemptedRetries);
+}
 
 //----------------------------------------------------------
 // Methods : S3fsAWSCredentialsProviderChain
 //----------------------------------------------------------
-S3fsAWSCredentialsProviderChain::S3fsAWSCredentialsProviderChain(const char* ssoprofile) : Aws::Auth::AWSCredentialsProviderChain()
+S3fsAWSCredentialsProviderChain::S3fsAWSCredentialsProviderChain(const char* ssoprofile, const std::shared_ptr<Aws::Auth::AWSCredentialsProvider>& ssoprovider, int64_t deadlinems, const std::shared_ptr<Aws::Auth::AWSCredentialsProvider>& stsprovider, const std::shared_ptr<Aws::Auth::AWSCredentialsProvider>& containerprovider) : Aws::Auth::AWSCredentialsProviderChain(), deadline(deadlinems), deadlineExceeded(false)
 {
-	AddProvider(Aws::MakeShared<Aws::Auth::EnvironmentAWSCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
-	AddProvider(Aws::MakeShared<Aws::Auth::ProfileConfigFileAWSCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
-	AddProvider(Aws::MakeShared<Aws::Auth::ProcessCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
-	AddProvider(Aws::MakeShared<Aws::Auth::STSAssumeRoleWebIdentityCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
-	AddProvider(Aws::MakeShared<Aws::Auth::STSProfileCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
+#ifdef S3FSAWSCRED_PROVIDER_ENV
+	AddNamedProvider("Environment", Aws::MakeShared<Aws::Auth::EnvironmentAWSCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
+#endif
+#ifdef S3FSAWSCRED_PROVIDER_PROFILE
+	AddNamedProvider("ProfileConfigFile", Aws::MakeShared<Aws::Auth::ProfileConfigFileAWSCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
+#endif
+#ifdef S3FSAWSCRED_PROVIDER_PROCESS
+	AddNamedProvider("Process", Aws::MakeShared<Aws::Auth::ProcessCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
+#endif
 
+#ifdef S3FSAWSCRED_PROVIDER_STS
+	// STS(Web Identity and AssumeRole)
+	if(stsprovider){
+		AddNamedProvider("S3fsSTS", stsprovider);
+	}else{
+		AddNamedProvider("STSAssumeRoleWebIdentity", Aws::MakeShared<Aws::Auth::STSAssumeRoleWebIdentityCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
+		AddNamedProvider("STSProfile", Aws::MakeShared<Aws::Auth::STSProfileCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
+	}
+#endif
+
+#ifdef S3FSAWSCRED_PROVIDER_SSO
 	// SSO
-	if(ssoprofile){
-		AddProvider(Aws::MakeShared<Aws::Auth::SSOCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag, ssoprofile));
+	if(ssoprovider){
+		AddNamedProvider("S3fsSSO", ssoprovider);
+	}else if(ssoprofile){
+		AddNamedProvider("SSO", Aws::MakeShared<Aws::Auth::SSOCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag, ssoprofile));
 	}else{
-		AddProvider(Aws::MakeShared<Aws::Auth::SSOCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
+		AddNamedProvider("SSO", Aws::MakeShared<Aws::Auth::SSOCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
 	}
+#endif
 
+#ifdef S3FSAWSCRED_PROVIDER_CONTAINER
 	//
 	// ECS TaskRole Credentials only available when ENVIRONMENT VARIABLE is set
 	//
@@ -53,26 +249,911 @@ S3fsAWSCredentialsProviderChain::S3fsAWSCredentialsProviderChain(const char* sso
 
 	const auto absoluteUri = Aws::Environment::GetEnv(S3FS_AWS_ECS_CONTAINER_CREDENTIALS_FULL_URI);
 	AWS_LOGSTREAM_DEBUG(S3fsDefaultCredentialsProviderChainTag, "The environment variable value " << S3FS_AWS_ECS_CONTAINER_CREDENTIALS_FULL_URI << " is " << absoluteUri);
+#endif
 
+#ifdef S3FSAWSCRED_PROVIDER_IMDS
 	const auto ec2MetadataDisabled = Aws::Environment::GetEnv(S3FS_AWS_EC2_METADATA_DISABLED);
 	AWS_LOGSTREAM_DEBUG(S3fsDefaultCredentialsProviderChainTag, "The environment variable value " << S3FS_AWS_EC2_METADATA_DISABLED << " is " << ec2MetadataDisabled);
+#endif
+
+	// [NOTE]
+	// If there is a deadline, the ECS and EC2 metadata providers use the
+	// clients whose timeouts and retries are limited by the deadline.
+	//
+	// [NOTE]
+	// If the container provider is specified, it is used instead of
+	// TaskRoleCredentialsProvider. It supports the authorization token
+	// file(EKS Pod Identity) and caches credentials.
+	//
+	// [NOTE]
+	// The container and EC2 metadata providers are exclusive. If the
+	// container provider is not built, the EC2 metadata provider is
+	// added regardless of the container environments.
+	//
+	bool	isContainer = false;
+#ifdef S3FSAWSCRED_PROVIDER_CONTAINER
+	if(containerprovider){
+		AddNamedProvider("S3fsContainer", containerprovider);
+		AWS_LOGSTREAM_INFO(S3fsDefaultCredentialsProviderChainTag, "Added container credentials provider to the provider chain.");
+		isContainer = true;
 
-	if(!relativeUri.empty()){
-		AddProvider(Aws::MakeShared<Aws::Auth::TaskRoleCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag, relativeUri.c_str()));
+	}else if(!relativeUri.empty()){
+		if(0 != deadline){
+			auto	client = Aws::MakeShared<Aws::Internal::ECSCredentialsClient>(S3fsDefaultCredentialsProviderChainTag, S3fsCreateClientConfiguration(deadline), relativeUri.c_str(), S3FS_AWS_ECS_CONTAINER_ENDPOINT, "");
+			AddNamedProvider("TaskRole", Aws::MakeShared<Aws::Auth::TaskRoleCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag, client));
+		}else{
+			AddNamedProvider("TaskRole", Aws::MakeShared<Aws::Auth::TaskRoleCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag, relativeUri.c_str()));
+		}
 		AWS_LOGSTREAM_INFO(S3fsDefaultCredentialsProviderChainTag, "Added ECS metadata service credentials provider with relative path: [" << relativeUri << "] to the provider chain.");
+		isContainer = true;
 
 	}else if(!absoluteUri.empty()){
 		const auto token = Aws::Environment::GetEnv(S3FS_AWS_ECS_CONTAINER_AUTHORIZATION_TOKEN);
-		AddProvider(Aws::MakeShared<Aws::Auth::TaskRoleCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag, absoluteUri.c_str(), token.c_str()));
+		if(0 != deadline){
+			auto	client = Aws::MakeShared<Aws::Internal::ECSCredentialsClient>(S3fsDefaultCredentialsProviderChainTag, S3fsCreateClientConfiguration(deadline), "", absoluteUri.c_str(), token.c_str());
+			AddNamedProvider("TaskRole", Aws::MakeShared<Aws::Auth::TaskRoleCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag, client));
+		}else{
+			AddNamedProvider("TaskRole", Aws::MakeShared<Aws::Auth::TaskRoleCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag, absoluteUri.c_str(), token.c_str()));
+		}
 
 		//DO NOT log the value of the authorization token for security purposes.
 		AWS_LOGSTREAM_INFO(S3fsDefaultCredentialsProviderChainTag, "Added ECS credentials provider with URI: [" << absoluteUri << "] to the provider chain with a" << (token.empty() ? "n empty " : " non-empty ") << "authorization token.");
+		isContainer = true;
+	}
+#endif
 
-	}else if(Aws::Utils::StringUtils::ToLower(ec2MetadataDisabled.c_str()) != "true"){
-		AddProvider(Aws::MakeShared<Aws::Auth::InstanceProfileCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
+#ifdef S3FSAWSCRED_PROVIDER_IMDS
+	if(!isContainer && Aws::Utils::StringUtils::ToLower(ec2MetadataDisabled.c_str()) != "true"){
+		if(0 != deadline){
+			auto	client = Aws::MakeShared<Aws::Internal::EC2MetadataClient>(S3fsDefaultCredentialsProviderChainTag, S3fsCreateClientConfiguration(deadline));
+			auto	loader = Aws::MakeShared<Aws::Config::EC2InstanceProfileConfigLoader>(S3fsDefaultCredentialsProviderChainTag, client);
+			AddNamedProvider("InstanceProfile", Aws::MakeShared<Aws::Auth::InstanceProfileCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag, loader));
+		}else{
+			AddNamedProvider("InstanceProfile", Aws::MakeShared<Aws::Auth::InstanceProfileCredentialsProvider>(S3fsDefaultCredentialsProviderChainTag));
+		}
 		AWS_LOGSTREAM_INFO(S3fsDefaultCredentialsProviderChainTag, "Added EC2 metadata service credentials provider to the provider chain.");
 	}
+#endif
+
+	// These are not used if some providers are not built
+	(void)isContainer;
+	(void)ssoprofile;
+	(void)ssoprovider;
+	(void)stsprovider;
+	(void)containerprovider;
+}
+
+void S3fsAWSCredentialsProviderChain::AddNamedProvider(const char* name, const std::shared_ptr<Aws::Auth::AWSCredentialsProvider>& provider)
+{
+	AddProvider(provider);
+	providerNames.push_back(name);
+}
+
+//
+// [NOTE]
+// This is the same as Aws::Auth::AWSCredentialsProviderChain::GetAWSCredentials,
+// but it fires the probes for each provider attempt, and does not try
+// the next provider after the deadline.
+//
+Aws::Auth::AWSCredentials S3fsAWSCredentialsProviderChain::GetAWSCredentials()
+{
+	const Aws::Vector<std::shared_ptr<Aws::Auth::AWSCredentialsProvider>>&	providers = GetProviders();
+
+	deadlineExceeded = false;
+	for(size_t cnt = 0; cnt < providers.size(); ++cnt){
+		const char*	name = (cnt < providerNames.size()) ? providerNames[cnt].c_str() : "Unknown";
+
+		if(0 == S3fsGetRemainingMs(deadline)){
+			AWS_LOGSTREAM_WARN(S3fsDefaultCredentialsProviderChainTag, "The deadline has passed before trying " << name << " credentials provider.");
+			deadlineExceeded = true;
+			break;
+		}
+		S3FSAWSCRED_PROBE2(provider_entry, cnt, name);
+
+		Aws::Auth::AWSCredentials	credentials	= providers[cnt]->GetAWSCredentials();
+		bool						result		= (!credentials.GetAWSAccessKeyId().empty() && !credentials.GetAWSSecretKey().empty());
+
+		S3FSAWSCRED_PROBE3(provider_return, cnt, name, result);
+		if(result){
+			AWS_LOGSTREAM_DEBUG(S3fsDefaultCredentialsProviderChainTag, "Got credentials from " << name << " credentials provider.");
+			return credentials;
+		}
+	}
+	return Aws::Auth::AWSCredentials();
+}
+
+//----------------------------------------------------------
+// Methods : S3fsCachedCredentialsProvider
+//----------------------------------------------------------
+S3fsCachedCredentialsProvider::S3fsCachedCredentialsProvider(const char* tagname, int64_t defaultmarginms) : Aws::Auth::AWSCredentialsProvider(), tag(tagname), defaultMargin(defaultmarginms), deadline(0), refreshMargin(0), refreshJitter(0), currentJitter(0), lastReloadMs(0), jitterRandom(static_cast<std::minstd_rand::result_type>(reinterpret_cast<uintptr_t>(this) ^ static_cast<uintptr_t>(S3fsGetMonotonicMs())))
+{
+}
+
+int64_t S3fsCachedCredentialsProvider::GetRefreshMargin() const
+{
+	return std::max<int64_t>(defaultMargin, refreshMargin);
+}
+
+//
+// Returns true if the cached credentials can be used without reloading.
+// This is called under the reload lock.
+//
+bool S3fsCachedCredentialsProvider::IsCacheValid(int64_t margin) const
+{
+	if(credentials.IsEmpty()){
+		return false;
+	}
+	if(!S3fsIsExpiredWithin(credentials, margin + currentJitter)){
+		return true;
+	}
+	return (!S3fsIsExpiredWithin(credentials, 0) && S3fsGetCurrentTimeMs() < (lastReloadMs + S3FS_MIN_RELOAD_INTERVAL_MS));
+}
+
+void S3fsCachedCredentialsProvider::RefreshIfExpired()
+{
+	int64_t	margin = GetRefreshMargin();
+
+	Aws::Utils::Threading::ReaderLockGuard	guard(m_reloadLock);
+	if(IsCacheValid(margin)){
+		S3FSAWSCRED_PROBE1(cache_hit, tag);
+		return;
+	}
+	guard.UpgradeToWriterLock();
+
+	// double-checked lock to avoid refreshing twice
+	if(IsCacheValid(margin)){
+		S3FSAWSCRED_PROBE1(cache_hit, tag);
+		return;
+	}
+	S3FSAWSCRED_PROBE1(cache_miss, tag);
+
+	lastReloadMs = S3fsGetCurrentTimeMs();
+	Reload();
+
+	// Choose the jitter for the new credentials
+	//
+	// [NOTE]
+	// The jitter is limited to half of the lifetime beyond the margin,
+	// otherwise the margin and the jitter cover the whole lifetime of
+	// short-lived credentials and they are reloaded at every call(after
+	// S3FS_MIN_RELOAD_INTERVAL_MS).
+	//
+	int64_t	jitter	= std::min<int64_t>(refreshJitter, (credentials.GetExpiration().Millis() - S3fsGetCurrentTimeMs() - margin) / 2);
+	currentJitter	= (0 < jitter) ? static_cast<int64_t>(jitterRandom() % static_cast<std::minstd_rand::result_type>(jitter)) : 0;
+}
+
+Aws::Auth::AWSCredentials S3fsCachedCredentialsProvider::GetAWSCredentials()
+{
+	if(!IsConfigured()){
+		return Aws::Auth::AWSCredentials();
+	}
+	RefreshIfExpired();
+
+	Aws::Utils::Threading::ReaderLockGuard	guard(m_reloadLock);
+	if(S3fsIsExpiredWithin(credentials, 0)){
+		return Aws::Auth::AWSCredentials();
+	}
+	return credentials;
+}
+
+#ifdef S3FSAWSCRED_PROVIDER_SSO
+//----------------------------------------------------------
+// Methods : S3fsSSOCredentialsProvider
+//----------------------------------------------------------
+S3fsSSOCredentialsProvider::S3fsSSOCredentialsProvider(const char* ssoprofile, const char* portal, const char* oidc) : S3fsCachedCredentialsProvider(S3fsSSOCredentialsProviderTag, S3FS_SSO_CREDENTIALS_REFRESH_MARGIN_MS), profileName(ssoprofile ? ssoprofile : ""), accessTokenExpiration(static_cast<int64_t>(0)), registrationExpiration(static_cast<int64_t>(0))
+{
+	if(profileName.empty()){
+		profileName = Aws::Auth::GetConfigProfileName();
+	}
+	if(!LoadProfile()){
+		AWS_LOGSTREAM_ERROR(S3fsSSOCredentialsProviderTag, "Profile [" << profileName << "] does not have enough SSO settings.");
+	}
+
+	// Endpoints(these can be overridden for local testing)
+	if(portal && '\0' != portal[0]){
+		portalEndpoint = portal;
+	}else{
+		portalEndpoint = "https://portal.sso." + ssoRegion + ".amazonaws.com";
+	}
+	if(oidc && '\0' != oidc[0]){
+		oidcEndpoint = oidc;
+	}else{
+		oidcEndpoint = "https://oidc." + ssoRegion + ".amazonaws.com";
+	}
+
+	Aws::Client::ClientConfiguration	config;
+	config.scheme	= Aws::Http::Scheme::HTTPS;
+	config.region	= ssoRegion;
+	httpClient		= Aws::Http::CreateHttpClient(config);
+
+	AWS_LOGSTREAM_INFO(S3fsSSOCredentialsProviderTag, "Setup SSO credentials provider for profile [" << profileName << "] with token cache file [" << cacheFilePath << "].");
+}
+
+bool S3fsSSOCredentialsProvider::LoadProfile()
+{
+	Aws::Config::Profile	profile = Aws::Config::GetCachedConfigProfile(profileName);
+
+	ssoAccountId	= profile.GetSsoAccountId();
+	ssoRoleName		= profile.GetSsoRoleName();
+
+	if(profile.IsSsoSessionSet()){
+		// New format, sso-session section
+		const Aws::Config::Profile::SsoSession&	session = profile.GetSsoSession();
+		ssoSessionName	= session.GetName();
+		ssoRegion		= session.GetSsoRegion();
+		ssoStartUrl		= session.GetSsoStartUrl();
+	}else{
+		// Legacy format
+		ssoRegion		= profile.GetSsoRegion();
+		ssoStartUrl		= profile.GetSsoStartUrl();
+	}
+
+	// Cache file name is the SHA1 hash of the session name(or start url for legacy format)
+	const Aws::String&	hashSource	= ssoSessionName.empty() ? ssoStartUrl : ssoSessionName;
+	Aws::String			hashName	= Aws::Utils::HashingUtils::HexEncode(Aws::Utils::HashingUtils::CalculateSHA1(hashSource));
+	cacheFilePath					= Aws::FileSystem::GetHomeDirectory() + ".aws" + Aws::FileSystem::PATH_DELIM + "sso" + Aws::FileSystem::PATH_DELIM + "cache" + Aws::FileSystem::PATH_DELIM + hashName + ".json";
+
+	return (!ssoAccountId.empty() && !ssoRoleName.empty() && !ssoRegion.empty() && !ssoStartUrl.empty());
+}
+
+//
+// Load the access token, refresh token and client registration from the cache file.
+//
+// [NOTE]
+// The cache file is read every time, because the user may log in again
+// with "aws sso login" and the cache file may be replaced.
+//
+bool S3fsSSOCredentialsProvider::LoadTokenCache()
+{
+	Aws::IFStream	inputFile(cacheFilePath.c_str());
+	if(!inputFile){
+		AWS_LOGSTREAM_ERROR(S3fsSSOCredentialsProviderTag, "Could not open SSO token cache file [" << cacheFilePath << "].");
+		return false;
+	}
+	Aws::Utils::Json::JsonValue	cacheJson(inputFile);
+	if(!cacheJson.WasParseSuccessful()){
+		AWS_LOGSTREAM_ERROR(S3fsSSOCredentialsProviderTag, "Could not parse SSO token cache file [" << cacheFilePath << "] : " << cacheJson.GetErrorMessage());
+		return false;
+	}
+	Aws::Utils::Json::JsonView	cacheView = cacheJson.View();
+
+	accessToken				= cacheView.GetString("accessToken");
+	accessTokenExpiration	= Aws::Utils::DateTime(static_cast<int64_t>(0));
+	if(cacheView.ValueExists("expiresAt")){
+		accessTokenExpiration = Aws::Utils::DateTime(cacheView.GetString("expiresAt"), Aws::Utils::DateFormat::ISO_8601);
+	}
+	refreshToken			= cacheView.ValueExists("refreshToken") ? cacheView.GetString("refreshToken") : "";
+	clientId				= cacheView.ValueExists("clientId")     ? cacheView.GetString("clientId")     : "";
+	clientSecret			= cacheView.ValueExists("clientSecret") ? cacheView.GetString("clientSecret") : "";
+	registrationExpiration	= Aws::Utils::DateTime(static_cast<int64_t>(0));
+	if(cacheView.ValueExists("registrationExpiresAt")){
+		registrationExpiration = Aws::Utils::DateTime(cacheView.GetString("registrationExpiresAt"), Aws::Utils::DateFormat::ISO_8601);
+	}
+	return !accessToken.empty();
+}
+
+//
+// Write back the refreshed access token to the cache file.
+//
+// [NOTE]
+// Other keys in the cache file are kept as is, so that the AWS CLI
+// can use the refreshed token too.
+// The file is replaced by rename, so the reader never sees a
+// partially written file.
+//
+bool S3fsSSOCredentialsProvider::SaveTokenCache()
+{
+	Aws::IFStream	inputFile(cacheFilePath.c_str());
+	if(!inputFile){
+		return false;
+	}
+	Aws::Utils::Json::JsonValue	cacheJson(inputFile);
+	inputFile.close();
+	if(!cacheJson.WasParseSuccessful()){
+		return false;
+	}
+	cacheJson.WithString("accessToken", accessToken);
+	cacheJson.WithString("expiresAt", accessTokenExpiration.ToGmtString(Aws::Utils::DateFormat::ISO_8601));
+	if(!refreshToken.empty()){
+		cacheJson.WithString("refreshToken", refreshToken);
+	}
+
+	// [NOTE]
+	// The temporary file is created by mkstemp(mode 0600 and a unique
+	// name), because it has the access token, refresh token and client
+	// secret, and other mounts may write this cache file at the same time.
+	//
+	Aws::String		tmpFilePath = cacheFilePath + ".s3fsawscred.XXXXXX";
+	Aws::String		strCache	= cacheJson.View().WriteReadable();
+	int				fd			= mkstemp(&tmpFilePath[0]);
+	if(-1 == fd){
+		AWS_LOGSTREAM_WARN(S3fsSSOCredentialsProviderTag, "Could not create temporary SSO token cache file [" << tmpFilePath << "] : errno=" << errno);
+		return false;
+	}
+	for(size_t written = 0; written < strCache.size(); ){
+		ssize_t	result = write(fd, strCache.c_str() + written, strCache.size() - written);
+		if(result <= 0){
+			if(-1 == result && EINTR == errno){
+				continue;
+			}
+			AWS_LOGSTREAM_WARN(S3fsSSOCredentialsProviderTag, "Could not write SSO token cache file [" << tmpFilePath << "] : errno=" << errno);
+			close(fd);
+			unlink(tmpFilePath.c_str());
+			return false;
+		}
+		written += static_cast<size_t>(result);
+	}
+	if(0 != close(fd)){
+		AWS_LOGSTREAM_WARN(S3fsSSOCredentialsProviderTag, "Could not write SSO token cache file [" << tmpFilePath << "] : errno=" << errno);
+		unlink(tmpFilePath.c_str());
+		return false;
+	}
+	if(0 != rename(tmpFilePath.c_str(), cacheFilePath.c_str())){
+		AWS_LOGSTREAM_WARN(S3fsSSOCredentialsProviderTag, "Could not replace SSO token cache file [" << cacheFilePath << "].");
+		unlink(tmpFilePath.c_str());
+		return false;
+	}
+	return true;
+}
+
+//
+// Refresh the access token with the refresh token(SSO OIDC CreateToken).
+//
+bool S3fsSSOCredentialsProvider::RefreshAccessToken()
+{
+	if(refreshToken.empty() || clientId.empty() || clientSecret.empty()){
+		AWS_LOGSTREAM_WARN(S3fsSSOCredentialsProviderTag, "SSO token cache does not have refresh token or client registration, so could not refresh access token.");
+		return false;
+	}
+	if(registrationExpiration.Millis() <= S3fsGetCurrentTimeMs()){
+		AWS_LOGSTREAM_WARN(S3fsSSOCredentialsProviderTag, "SSO client registration has expired, so could not refresh access token.");
+		return false;
+	}
+
+	Aws::Utils::Json::JsonValue	requestJson;
+	requestJson.WithString("clientId", clientId);
+	requestJson.WithString("clientSecret", clientSecret);
+	requestJson.WithString("grantType", "refresh_token");
+	requestJson.WithString("refreshToken", refreshToken);
+	Aws::String	payload = requestJson.View().WriteCompact();
+
+	auto	request	= Aws::Http::CreateHttpRequest(Aws::Http::URI(oidcEndpoint + "/token"), Aws::Http::HttpMethod::HTTP_POST, Aws::Utils::Stream::DefaultResponseStreamFactoryMethod);
+	auto	body	= Aws::MakeShared<Aws::StringStream>(S3fsSSOCredentialsProviderTag);
+	*body << payload;
+	request->AddContentBody(body);
+	request->SetContentType("application/json");
+	request->SetContentLength(Aws::Utils::StringUtils::to_string(payload.size()));
+
+	auto	response = GetHttpClient()->MakeRequest(request);
+	if(!response || Aws::Http::HttpResponseCode::OK != response->GetResponseCode()){
+		AWS_LOGSTREAM_ERROR(S3fsSSOCredentialsProviderTag, "Failed to refresh SSO access token : response code = " << (response ? static_cast<int>(response->GetResponseCode()) : -1));
+		return false;
+	}
+	Aws::Utils::Json::JsonValue	responseJson(response->GetResponseBody());
+	if(!responseJson.WasParseSuccessful()){
+		AWS_LOGSTREAM_ERROR(S3fsSSOCredentialsProviderTag, "Failed to parse SSO OIDC response : " << responseJson.GetErrorMessage());
+		return false;
+	}
+	Aws::Utils::Json::JsonView	responseView = responseJson.View();
+	if(!responseView.ValueExists("accessToken") || responseView.GetString("accessToken").empty()){
+		AWS_LOGSTREAM_ERROR(S3fsSSOCredentialsProviderTag, "SSO OIDC response does not have access token.");
+		return false;
+	}
+
+	accessToken				= responseView.GetString("accessToken");
+	accessTokenExpiration	= Aws::Utils::DateTime(S3fsGetCurrentTimeMs() + (static_cast<int64_t>(responseView.GetInteger("expiresIn")) * 1000));
+	if(responseView.ValueExists("refreshToken") && !responseView.GetString("refreshToken").empty()){
+		refreshToken		= responseView.GetString("refreshToken");
+	}
+	AWS_LOGSTREAM_INFO(S3fsSSOCredentialsProviderTag, "Refreshed SSO access token, it expires at " << accessTokenExpiration.ToGmtString(Aws::Utils::DateFormat::ISO_8601));
+
+	if(!SaveTokenCache()){
+		AWS_LOGSTREAM_WARN(S3fsSSOCredentialsProviderTag, "Could not save refreshed SSO access token to cache file, but continue.");
+	}
+	return true;
+}
+
+//
+// Get role credentials from SSO portal(SSO GetRoleCredentials).
+//
+bool S3fsSSOCredentialsProvider::GetRoleCredentials()
+{
+	Aws::String	url = portalEndpoint + "/federation/credentials?account_id=" + Aws::Utils::StringUtils::URLEncode(ssoAccountId.c_str()) + "&role_name=" + Aws::Utils::StringUtils::URLEncode(ssoRoleName.c_str());
+
+	auto	request = Aws::Http::CreateHttpRequest(Aws::Http::URI(url), Aws::Http::HttpMethod::HTTP_GET, Aws::Utils::Stream::DefaultResponseStreamFactoryMethod);
+	request->SetHeaderValue(S3FS_SSO_BEARER_TOKEN_HEADER, accessToken);
+
+	auto	response = GetHttpClient()->MakeRequest(request);
+	if(!response || Aws::Http::HttpResponseCode::OK != response->GetResponseCode()){
+		AWS_LOGSTREAM_ERROR(S3fsSSOCredentialsProviderTag, "Failed to get SSO role credentials : response code = " << (response ? static_cast<int>(response->GetResponseCode()) : -1));
+		return false;
+	}
+	Aws::Utils::Json::JsonValue	responseJson(response->GetResponseBody());
+	if(!responseJson.WasParseSuccessful()){
+		AWS_LOGSTREAM_ERROR(S3fsSSOCredentialsProviderTag, "Failed to parse SSO GetRoleCredentials response : " << responseJson.GetErrorMessage());
+		return false;
+	}
+	Aws::Utils::Json::JsonView	roleView = responseJson.View().GetObject("roleCredentials");
+	if(!roleView.ValueExists("accessKeyId") || !roleView.ValueExists("secretAccessKey")){
+		AWS_LOGSTREAM_ERROR(S3fsSSOCredentialsProviderTag, "SSO GetRoleCredentials response does not have credentials.");
+		return false;
+	}
+
+	credentials.SetAWSAccessKeyId(roleView.GetString("accessKeyId"));
+	credentials.SetAWSSecretKey(roleView.GetString("secretAccessKey"));
+	credentials.SetSessionToken(roleView.GetString("sessionToken"));
+	credentials.SetExpiration(Aws::Utils::DateTime(roleView.GetInt64("expiration")));
+
+	AWS_LOGSTREAM_INFO(S3fsSSOCredentialsProviderTag, "Got SSO role credentials, these expire at " << credentials.GetExpiration().ToGmtString(Aws::Utils::DateFormat::ISO_8601));
+	return true;
+}
+
+//
+// Returns the http client for SSO requests.
+//
+// [NOTE]
+// If there is a deadline, a new client whose timeouts are limited by
+// the remaining time is created(this happens only when refreshing).
+//
+std::shared_ptr<Aws::Http::HttpClient> S3fsSSOCredentialsProvider::GetHttpClient() const
+{
+	int64_t	deadlinems = deadline;
+	if(0 == deadlinems){
+		return httpClient;
+	}
+	Aws::Client::ClientConfiguration	config = S3fsCreateClientConfiguration(deadlinems);
+	config.scheme	= Aws::Http::Scheme::HTTPS;
+	config.region	= ssoRegion;
+	return Aws::Http::CreateHttpClient(config);
+}
+
+void S3fsSSOCredentialsProvider::Reload()
+{
+	if(!LoadTokenCache()){
+		AWS_LOGSTREAM_WARN(S3fsSSOCredentialsProviderTag, "Could not load SSO access token from cache file.");
+	}
+
+	// Refresh access token before it expires
+	if(accessToken.empty() || accessTokenExpiration.Millis() <= (S3fsGetCurrentTimeMs() + S3FS_SSO_TOKEN_REFRESH_MARGIN_MS)){
+		bool	refreshed = RefreshAccessToken();
+		S3FSAWSCRED_PROBE2(cache_refresh, S3fsSSOCredentialsProviderTag, refreshed);
+
+		if(!refreshed && (accessToken.empty() || accessTokenExpiration.Millis() <= S3fsGetCurrentTimeMs())){
+			AWS_LOGSTREAM_ERROR(S3fsSSOCredentialsProviderTag, "SSO access token has expired and could not be refreshed, you need to log in again.");
+			return;
+		}
+	}
+
+	// [NOTE]
+	// If this fails, the current credentials are kept until they expire.
+	//
+	GetRoleCredentials();
+	AWSCredentialsProvider::Reload();
+}
+#endif
+
+#ifdef S3FSAWSCRED_PROVIDER_STS
+//----------------------------------------------------------
+// Methods : S3fsSTSEndpointSelector
+//----------------------------------------------------------
+//
+// strEndpoints is a list of regions or URLs separated by ';'.
+// (ex. "us-west-2;us-east-1;http://127.0.0.1:8080")
+// A region is converted to "https://sts.<region>.amazonaws.com".
+// For a URL, the signing region is taken from the host name if it
+// is "sts.<region>.amazonaws.com", otherwise from AWS_REGION(or
+// AWS_DEFAULT_REGION) environment or us-east-1.
+//
+S3fsSTSEndpointSelector::S3fsSTSEndpointSelector(const Aws::String& strEndpoints)
+{
+	Aws::String	defaultRegion = GetDefaultRegion();
+
+	Aws::Vector<Aws::String>	entries = Aws::Utils::StringUtils::Split(strEndpoints, ';');
+	for(Aws::Vector<Aws::String>::const_iterator iter = entries.begin(); iter != entries.end(); ++iter){
+		Aws::String	entry = Aws::Utils::StringUtils::Trim(iter->c_str());
+		if(entry.empty()){
+			continue;
+		}
+		S3FSSTSENDPOINT	endpoint;
+		if(Aws::String::npos == entry.find("://")){
+			endpoint.url	= "https://sts." + entry + ".amazonaws.com";
+			endpoint.region	= entry;
+		}else{
+			endpoint.url	= entry;
+			endpoint.region	= defaultRegion;
+
+			Aws::String::size_type	startPos = entry.find("://sts.");
+			Aws::String::size_type	endPos	 = entry.find(".amazonaws.com");
+			if(Aws::String::npos != startPos && Aws::String::npos != endPos && (startPos + 7) < endPos){
+				endpoint.region = entry.substr(startPos + 7, endPos - (startPos + 7));
+			}
+		}
+		endpoint.latencyMs		= -1.0;
+		endpoint.errorRate		= 0.0;
+		endpoint.lastErrorMs	= 0;
+		endpoint.lastFailed		= false;
+		endpoints.push_back(endpoint);
+
+		AWS_LOGSTREAM_INFO(S3fsSTSCredentialsProviderTag, "Added STS endpoint [" << endpoint.url << "] with signing region [" << endpoint.region << "].");
+	}
+}
+
+//
+// Returns AWS_REGION(or AWS_DEFAULT_REGION) environment or us-east-1.
+//
+Aws::String S3fsSTSEndpointSelector::GetDefaultRegion()
+{
+	Aws::String	region = Aws::Environment::GetEnv(S3FS_AWS_REGION);
+	if(region.empty()){
+		region = Aws::Environment::GetEnv(S3FS_AWS_DEFAULT_REGION);
+	}
+	if(region.empty()){
+		region = S3FS_STS_DEFAULT_REGION;
+	}
+	return region;
+}
+
+Aws::Vector<size_t> S3fsSTSEndpointSelector::GetOrder() const
+{
+	std::lock_guard<std::mutex>	guard(lock);
+	int64_t						nowms = S3fsGetCurrentTimeMs();
+
+	Aws::Vector<size_t>	healthy;
+	Aws::Vector<size_t>	unhealthy;
+	for(size_t cnt = 0; cnt < endpoints.size(); ++cnt){
+		if(endpoints[cnt].errorRate < S3FS_STS_UNHEALTHY_ERROR_RATE || (endpoints[cnt].lastErrorMs + S3FS_STS_RETRY_UNHEALTHY_MS) <= nowms){
+			healthy.push_back(cnt);
+		}else{
+			unhealthy.push_back(cnt);
+		}
+	}
+
+	// Healthy endpoints : the endpoints whose last request failed are
+	// after the others, then not measured yet first, and the fastest
+	// [NOTE]
+	// stable_sort keeps the specified order for the same latency.
+	//
+	std::stable_sort(healthy.begin(), healthy.end(), [this](size_t lhs, size_t rhs){
+		if(endpoints[lhs].lastFailed != endpoints[rhs].lastFailed){
+			return !endpoints[lhs].lastFailed;
+		}
+		return endpoints[lhs].latencyMs < endpoints[rhs].latencyMs;
+	});
+
+	// Unhealthy endpoints : the oldest error first
+	std::stable_sort(unhealthy.begin(), unhealthy.end(), [this](size_t lhs, size_t rhs){
+		return endpoints[lhs].lastErrorMs < endpoints[rhs].lastErrorMs;
+	});
+
+	healthy.insert(healthy.end(), unhealthy.begin(), unhealthy.end());
+	return healthy;
+}
+
+void S3fsSTSEndpointSelector::Report(size_t index, bool success, int64_t latencyms)
+{
+	std::lock_guard<std::mutex>	guard(lock);
+	if(endpoints.size() <= index){
+		return;
+	}
+	S3FSSTSENDPOINT&	endpoint = endpoints[index];
+
+	// [NOTE]
+	// The latency is measured only for successful requests, because a
+	// dead endpoint(ex. connection refused) fails quickly and it must
+	// not look like the fastest endpoint.
+	//
+	if(success){
+		if(endpoint.latencyMs < 0.0){
+			endpoint.latencyMs = static_cast<double>(latencyms);
+		}else{
+			endpoint.latencyMs = (S3FS_STS_EWMA_ALPHA * static_cast<double>(latencyms)) + ((1.0 - S3FS_STS_EWMA_ALPHA) * endpoint.latencyMs);
+		}
+	}
+	endpoint.errorRate	= (S3FS_STS_EWMA_ALPHA * (success ? 0.0 : 1.0)) + ((1.0 - S3FS_STS_EWMA_ALPHA) * endpoint.errorRate);
+	endpoint.lastFailed	= !success;
+	if(!success){
+		endpoint.lastErrorMs = S3fsGetCurrentTimeMs();
+	}
+	AWS_LOGSTREAM_DEBUG(S3fsSTSCredentialsProviderTag, "STS endpoint [" << endpoint.url << "] : latency = " << latencyms << "ms(" << (success ? "success" : "failure") << "), average latency = " << endpoint.latencyMs << "ms, error rate = " << endpoint.errorRate);
+}
+
+//----------------------------------------------------------
+// Methods : S3fsSTSCredentialsProvider
+//----------------------------------------------------------
+S3fsSTSCredentialsProvider::S3fsSTSCredentialsProvider(const std::shared_ptr<S3fsSTSEndpointSelector>& endpointselector) : S3fsCachedCredentialsProvider(S3fsSTSCredentialsProviderTag, S3FS_STS_CREDENTIALS_REFRESH_MARGIN_MS), selector(endpointselector)
+{
+	Aws::Config::Profile	profile = Aws::Config::GetCachedConfigProfile(Aws::Auth::GetConfigProfileName());
+
+	// Web Identity from environments, or profile
+	roleArn		= Aws::Environment::GetEnv(S3FS_AWS_ROLE_ARN);
+	tokenFile	= Aws::Environment::GetEnv(S3FS_AWS_WEB_IDENTITY_TOKEN_FILE);
+	sessionName	= Aws::Environment::GetEnv(S3FS_AWS_ROLE_SESSION_NAME);
+	if(roleArn.empty() || tokenFile.empty()){
+		roleArn		= profile.GetRoleArn();
+		tokenFile	= profile.GetValue("web_identity_token_file");
+		sessionName	= profile.GetValue("role_session_name");
+	}
+
+	// AssumeRole from profile
+	if(!roleArn.empty() && tokenFile.empty()){
+		Aws::String	sourceProfile = profile.GetSourceProfile();
+		if(!sourceProfile.empty()){
+			sourceProvider	= Aws::MakeShared<Aws::Auth::ProfileConfigFileAWSCredentialsProvider>(S3fsSTSCredentialsProviderTag, sourceProfile.c_str());
+			externalId		= profile.GetExternalId();
+		}
+	}
+	if(sessionName.empty()){
+		sessionName = "s3fs-awscred-" + Aws::Utils::StringUtils::to_string(S3fsGetCurrentTimeMs());
+	}
+
+	if(IsConfigured()){
+		AWS_LOGSTREAM_INFO(S3fsSTSCredentialsProviderTag, "Setup STS credentials provider(" << (IsWebIdentity() ? "AssumeRoleWithWebIdentity" : "AssumeRole") << ") for role [" << roleArn << "] with " << selector->Size() << " endpoints.");
+	}else{
+		AWS_LOGSTREAM_DEBUG(S3fsSTSCredentialsProviderTag, "There is no web identity or assume role setting, so STS credentials provider is not used.");
+	}
+}
+
+//
+// Send request to one STS endpoint, and set credentials from the response.
+//
+bool S3fsSTSCredentialsProvider::RequestCredentials(size_t index, const Aws::String& payload)
+{
+	Aws::Client::ClientConfiguration	config = S3fsCreateClientConfiguration(deadline);
+	config.connectTimeoutMs		= std::min(config.connectTimeoutMs, S3FS_STS_CONNECT_TIMEOUT_MS);
+	config.requestTimeoutMs		= std::min(config.requestTimeoutMs, S3FS_STS_REQUEST_TIMEOUT_MS);
+	config.httpRequestTimeoutMs	= (0 == config.httpRequestTimeoutMs) ? S3FS_STS_REQUEST_TIMEOUT_MS : std::min(config.httpRequestTimeoutMs, S3FS_STS_REQUEST_TIMEOUT_MS);
+	config.region				= selector->GetRegion(index);
+	auto	httpClient			= Aws::Http::CreateHttpClient(config);
+
+	auto	request	= Aws::Http::CreateHttpRequest(Aws::Http::URI(selector->GetUrl(index)), Aws::Http::HttpMethod::HTTP_POST, Aws::Utils::Stream::DefaultResponseStreamFactoryMethod);
+	auto	body	= Aws::MakeShared<Aws::StringStream>(S3fsSTSCredentialsProviderTag);
+	*body << payload;
+	request->AddContentBody(body);
+	request->SetContentType("application/x-www-form-urlencoded; charset=utf-8");
+	request->SetContentLength(Aws::Utils::StringUtils::to_string(payload.size()));
+
+	// AssumeRole needs signing with the source credentials
+	if(!IsWebIdentity()){
+		Aws::Client::AWSAuthV4Signer	signer(sourceProvider, "sts", selector->GetRegion(index));
+		if(!signer.SignRequest(*request)){
+			AWS_LOGSTREAM_ERROR(S3fsSTSCredentialsProviderTag, "Could not sign AssumeRole request with source profile credentials.");
+			return false;
+		}
+	}
+
+	auto	response = httpClient->MakeRequest(request);
+	if(!response || Aws::Http::HttpResponseCode::OK != response->GetResponseCode()){
+		AWS_LOGSTREAM_WARN(S3fsSTSCredentialsProviderTag, "Failed request to STS endpoint [" << selector->GetUrl(index) << "] : response code = " << (response ? static_cast<int>(response->GetResponseCode()) : -1));
+		return false;
+	}
+
+	Aws::StringStream	ss;
+	ss << response->GetResponseBody().rdbuf();
+	Aws::Utils::Xml::XmlDocument	xmlDocument = Aws::Utils::Xml::XmlDocument::CreateFromXmlString(ss.str());
+	if(!xmlDocument.WasParseSuccessful()){
+		AWS_LOGSTREAM_WARN(S3fsSTSCredentialsProviderTag, "Failed to parse response from STS endpoint [" << selector->GetUrl(index) << "].");
+		return false;
+	}
+	Aws::Utils::Xml::XmlNode	credentialsNode = xmlDocument.GetRootElement().FirstChild(IsWebIdentity() ? "AssumeRoleWithWebIdentityResult" : "AssumeRoleResult").FirstChild("Credentials");
+	if(credentialsNode.IsNull() || credentialsNode.FirstChild("AccessKeyId").IsNull() || credentialsNode.FirstChild("SecretAccessKey").IsNull()){
+		AWS_LOGSTREAM_WARN(S3fsSTSCredentialsProviderTag, "Response from STS endpoint [" << selector->GetUrl(index) << "] does not have credentials.");
+		return false;
+	}
+
+	credentials.SetAWSAccessKeyId(credentialsNode.FirstChild("AccessKeyId").GetText());
+	credentials.SetAWSSecretKey(credentialsNode.FirstChild("SecretAccessKey").GetText());
+	credentials.SetSessionToken(credentialsNode.FirstChild("SessionToken").GetText());
+	credentials.SetExpiration(Aws::Utils::DateTime(Aws::Utils::StringUtils::Trim(credentialsNode.FirstChild("Expiration").GetText().c_str()), Aws::Utils::DateFormat::ISO_8601));
+
+	return true;
+}
+
+void S3fsSTSCredentialsProvider::Reload()
+{
+	// Make request payload
+	Aws::StringStream	payload;
+	if(IsWebIdentity()){
+		Aws::IFStream	tokenStream(tokenFile.c_str());
+		Aws::String		token;
+		if(!tokenStream || !std::getline(tokenStream, token) || token.empty()){
+			AWS_LOGSTREAM_ERROR(S3fsSTSCredentialsProviderTag, "Could not read web identity token file [" << tokenFile << "].");
+			return;
+		}
+		payload << "Action=AssumeRoleWithWebIdentity&Version=2011-06-15";
+		payload << "&RoleArn="			<< Aws::Utils::StringUtils::URLEncode(roleArn.c_str());
+		payload << "&RoleSessionName="	<< Aws::Utils::StringUtils::URLEncode(sessionName.c_str());
+		payload << "&WebIdentityToken="	<< Aws::Utils::StringUtils::URLEncode(token.c_str());
+	}else{
+		payload << "Action=AssumeRole&Version=2011-06-15";
+		payload << "&RoleArn="			<< Aws::Utils::StringUtils::URLEncode(roleArn.c_str());
+		payload << "&RoleSessionName="	<< Aws::Utils::StringUtils::URLEncode(sessionName.c_str());
+		if(!externalId.empty()){
+			payload << "&ExternalId="	<< Aws::Utils::StringUtils::URLEncode(externalId.c_str());
+		}
+	}
+
+	// Try endpoints in order of the selector
+	Aws::Vector<size_t>	order = selector->GetOrder();
+	for(Aws::Vector<size_t>::const_iterator iter = order.begin(); iter != order.end(); ++iter){
+		if(0 == S3fsGetRemainingMs(deadline)){
+			AWS_LOGSTREAM_WARN(S3fsSTSCredentialsProviderTag, "The deadline has passed before trying STS endpoint [" << selector->GetUrl(*iter) << "].");
+			break;
+		}
+		std::chrono::steady_clock::time_point	start	= std::chrono::steady_clock::now();
+		bool									result	= RequestCredentials(*iter, payload.str());
+		int64_t									elapsed	= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+		selector->Report(*iter, result, elapsed);
+		S3FSAWSCRED_PROBE3(sts_endpoint, *iter, selector->GetUrl(*iter).c_str(), result);
+
+		if(result){
+			AWS_LOGSTREAM_INFO(S3fsSTSCredentialsProviderTag, "Got credentials from STS endpoint [" << selector->GetUrl(*iter) << "] in " << elapsed << "ms, these expire at " << credentials.GetExpiration().ToGmtString(Aws::Utils::DateFormat::ISO_8601));
+			AWSCredentialsProvider::Reload();
+			return;
+		}
+	}
+	AWS_LOGSTREAM_ERROR(S3fsSTSCredentialsProviderTag, "Could not get credentials from any STS endpoint.");
+}
+#endif
+
+#ifdef S3FSAWSCRED_PROVIDER_CONTAINER
+//----------------------------------------------------------
+// Methods : S3fsContainerCredentialsProvider
+//----------------------------------------------------------
+// [NOTE]
+// The member name of modification time in struct stat is different
+// on macOS.
+//
+static const struct timespec& GetStatMtime(const struct stat& st)
+{
+#ifdef __APPLE__
+	return st.st_mtimespec;
+#else
+	return st.st_mtim;
+#endif
+}
+
+S3fsContainerCredentialsProvider::S3fsContainerCredentialsProvider(const char* relativeUri, const char* absoluteUri) : S3fsCachedCredentialsProvider(S3fsContainerCredentialsProviderTag, S3FS_CONTAINER_CREDENTIALS_REFRESH_MARGIN_MS), tokenFileIno(0), tokenFileSize(0)
+{
+	tokenFileMtime.tv_sec	= 0;
+	tokenFileMtime.tv_nsec	= 0;
+
+	if(relativeUri && '\0' != relativeUri[0]){
+		endpoint = Aws::String(S3FS_AWS_ECS_CONTAINER_ENDPOINT) + relativeUri;
+	}else if(absoluteUri && '\0' != absoluteUri[0]){
+		endpoint = absoluteUri;
+	}
+	if(!endpoint.empty() && !IsValidEndpoint(endpoint)){
+		AWS_LOGSTREAM_ERROR(S3fsContainerCredentialsProviderTag, "Container credentials endpoint [" << endpoint << "] is not allowed, it must be https or loopback/container host address.");
+		endpoint.clear();
+		return;
+	}
+
+	tokenFile = Aws::Environment::GetEnv(S3FS_AWS_ECS_CONTAINER_AUTHORIZATION_TOKEN_FILE);
+	if(tokenFile.empty()){
+		token = Aws::Environment::GetEnv(S3FS_AWS_ECS_CONTAINER_AUTHORIZATION_TOKEN);
+	}
+
+	//DO NOT log the value of the authorization token for security purposes.
+	AWS_LOGSTREAM_INFO(S3fsContainerCredentialsProviderTag, "Setup container credentials provider with URI: [" << endpoint << "] and " << (!tokenFile.empty() ? "authorization token file." : (token.empty() ? "no authorization token." : "authorization token.")));
+}
+
+//
+// The endpoint over http must be the loopback or the container host
+// address(ECS: 169.254.170.2, EKS Pod Identity: 169.254.170.23 or
+// fd00:ec2::23), because the authorization token is sent to it.
+//
+bool S3fsContainerCredentialsProvider::IsValidEndpoint(const Aws::String& url)
+{
+	Aws::Http::URI	uri(url);
+	if(Aws::Http::Scheme::HTTPS == uri.GetScheme()){
+		return true;
+	}
+	const Aws::String&	host = uri.GetAuthority();
+	return (0 == host.compare(0, 4, "127.") || "localhost" == host || "::1" == host || "[::1]" == host || "169.254.170.2" == host || "169.254.170.23" == host || "fd00:ec2::23" == host || "[fd00:ec2::23]" == host);
+}
+
+//
+// Read the token file only if it has been changed(or force is true).
+//
+bool S3fsContainerCredentialsProvider::LoadTokenFile(bool force)
+{
+	if(tokenFile.empty()){
+		return true;
+	}
+	struct stat	st;
+	if(-1 == stat(tokenFile.c_str(), &st)){
+		AWS_LOGSTREAM_ERROR(S3fsContainerCredentialsProviderTag, "Could not stat authorization token file [" << tokenFile << "].");
+		return false;
+	}
+	if(!force && !token.empty() && tokenFileIno == st.st_ino && tokenFileSize == st.st_size && tokenFileMtime.tv_sec == GetStatMtime(st).tv_sec && tokenFileMtime.tv_nsec == GetStatMtime(st).tv_nsec){
+		S3FSAWSCRED_PROBE1(cache_hit, S3FS_AWS_ECS_CONTAINER_AUTHORIZATION_TOKEN_FILE);
+		return true;
+	}
+	S3FSAWSCRED_PROBE1(cache_miss, S3FS_AWS_ECS_CONTAINER_AUTHORIZATION_TOKEN_FILE);
+
+	Aws::IFStream	tokenStream(tokenFile.c_str());
+	Aws::String		newToken;
+	if(!tokenStream || !std::getline(tokenStream, newToken)){
+		AWS_LOGSTREAM_ERROR(S3fsContainerCredentialsProviderTag, "Could not read authorization token file [" << tokenFile << "].");
+		return false;
+	}
+	newToken = Aws::Utils::StringUtils::Trim(newToken.c_str());
+	if(newToken.empty()){
+		AWS_LOGSTREAM_ERROR(S3fsContainerCredentialsProviderTag, "Authorization token file [" << tokenFile << "] is empty.");
+		return false;
+	}
+	token			= newToken;
+	tokenFileIno	= st.st_ino;
+	tokenFileSize	= st.st_size;
+	tokenFileMtime	= GetStatMtime(st);
+
+	AWS_LOGSTREAM_DEBUG(S3fsContainerCredentialsProviderTag, "Read authorization token file [" << tokenFile << "].");
+	return true;
+}
+
+bool S3fsContainerCredentialsProvider::RequestCredentials(bool& isAuthError)
+{
+	isAuthError = false;
+
+	auto	httpClient	= Aws::Http::CreateHttpClient(S3fsCreateClientConfiguration(deadline));
+	auto	request		= Aws::Http::CreateHttpRequest(Aws::Http::URI(endpoint), Aws::Http::HttpMethod::HTTP_GET, Aws::Utils::Stream::DefaultResponseStreamFactoryMethod);
+	if(!token.empty()){
+		request->SetHeaderValue("Authorization", token);
+	}
+
+	auto	response = httpClient->MakeRequest(request);
+	if(!response || Aws::Http::HttpResponseCode::OK != response->GetResponseCode()){
+		if(response && (Aws::Http::HttpResponseCode::UNAUTHORIZED == response->GetResponseCode() || Aws::Http::HttpResponseCode::FORBIDDEN == response->GetResponseCode())){
+			isAuthError = true;
+		}
+		AWS_LOGSTREAM_ERROR(S3fsContainerCredentialsProviderTag, "Failed to get container credentials : response code = " << (response ? static_cast<int>(response->GetResponseCode()) : -1));
+		return false;
+	}
+	Aws::Utils::Json::JsonValue	responseJson(response->GetResponseBody());
+	if(!responseJson.WasParseSuccessful()){
+		AWS_LOGSTREAM_ERROR(S3fsContainerCredentialsProviderTag, "Failed to parse container credentials response : " << responseJson.GetErrorMessage());
+		return false;
+	}
+	Aws::Utils::Json::JsonView	responseView = responseJson.View();
+	if(!responseView.ValueExists("AccessKeyId") || !responseView.ValueExists("SecretAccessKey")){
+		AWS_LOGSTREAM_ERROR(S3fsContainerCredentialsProviderTag, "Container credentials response does not have credentials.");
+		return false;
+	}
+
+	credentials.SetAWSAccessKeyId(responseView.GetString("AccessKeyId"));
+	credentials.SetAWSSecretKey(responseView.GetString("SecretAccessKey"));
+	credentials.SetSessionToken(responseView.ValueExists("Token") ? responseView.GetString("Token") : "");
+	if(responseView.ValueExists("Expiration")){
+		credentials.SetExpiration(Aws::Utils::DateTime(responseView.GetString("Expiration"), Aws::Utils::DateFormat::ISO_8601));
+	}else{
+		// [NOTE]
+		// The expiration of the previous credentials must not be kept for
+		// the new ones. These are refreshed after a bounded period.
+		//
+		credentials.SetExpiration(Aws::Utils::DateTime(S3fsGetCurrentTimeMs() + S3FS_CONTAINER_CREDENTIALS_DEFAULT_PERIOD_MS));
+	}
+
+	AWS_LOGSTREAM_INFO(S3fsContainerCredentialsProviderTag, "Got container credentials, these expire at " << credentials.GetExpiration().ToGmtString(Aws::Utils::DateFormat::ISO_8601));
+	return true;
+}
+
+void S3fsContainerCredentialsProvider::Reload()
+{
+	if(!LoadTokenFile(false)){
+		return;
+	}
+
+	bool	isAuthError = false;
+	if(!RequestCredentials(isAuthError) && isAuthError && !tokenFile.empty()){
+		// The token may have been rotated just now, so read it again and retry once.
+		if(!LoadTokenFile(true) || !RequestCredentials(isAuthError)){
+			return;
+		}
+	}
+	AWSCredentialsProvider::Reload();
 }
+#endif
 
 /*
  * Local variables:
@@ -16,16 +16,105 @@
  * limitations under the License.
  */
 
+#include <sys/types.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <random>
+
+//----------------------------------------------------------
+// Providers built into this library
+//----------------------------------------------------------
+// [NOTE]
+// The providers can be selected at build time with the cmake option
+// S3FSAWSCRED_PROVIDERS(ex. -DS3FSAWSCRED_PROVIDERS="imds;env"). Then
+// S3FSAWSCRED_PROVIDERS_SELECTED and S3FSAWSCRED_PROVIDER_<NAME> for
+// each selected provider are defined, and the other providers(and the
+// aws-sdk-cpp headers and libraries used only by them) are not built
+// into this library.
+// If the option is not specified, all providers are built.
+//
+#ifndef S3FSAWSCRED_PROVIDERS_SELECTED
+#define	S3FSAWSCRED_PROVIDER_ENV
+#define	S3FSAWSCRED_PROVIDER_PROFILE
+#define	S3FSAWSCRED_PROVIDER_PROCESS
+#define	S3FSAWSCRED_PROVIDER_STS
+#define	S3FSAWSCRED_PROVIDER_SSO
+#define	S3FSAWSCRED_PROVIDER_CONTAINER
+#define	S3FSAWSCRED_PROVIDER_IMDS
+#endif
+
 #include <aws/core/Aws.h>
 #include <aws/core/auth/AWSCredentials.h>
 #include <aws/core/auth/AWSCredentialsProvider.h>
 #include <aws/core/auth/AWSCredentialsProviderChain.h>
+#ifdef S3FSAWSCRED_PROVIDER_STS
 #include <aws/core/auth/STSCredentialsProvider.h>
-#include <aws/core/auth/SSOCredentialsProvider.h>
 #include <aws/identity-management/auth/STSProfileCredentialsProvider.h>
+#endif
+#ifdef S3FSAWSCRED_PROVIDER_SSO
+#include <aws/core/auth/SSOCredentialsProvider.h>
+#endif
 #include <aws/core/platform/Environment.h>
 #include <aws/core/utils/DateTime.h>
 #include <aws/core/utils/logging/LogMacros.h>
+#include <aws/core/utils/threading/ReaderWriterLock.h>
+#include <aws/core/http/HttpClient.h>
+#include <aws/core/client/ClientConfiguration.h>
+#include <aws/core/client/DefaultRetryStrategy.h>
+
+//----------------------------------------------------------
+// Clock utilities
+//----------------------------------------------------------
+// [NOTE]
+// The monotonic clock is not changed by the wall clock step(ex. NTP),
+// so it is used to measure the remaining time of credentials.
+// CLOCK_MONOTONIC_COARSE is used if available, it is read without a
+// system call and its resolution(a few milliseconds) is enough.
+//
+// [NOTE]
+// All expiration and refresh checks in this library read the time with
+// these functions. If a virtual clock is set(S3fsSetVirtualClock), both
+// functions return its time(milliseconds from epoch), so a simulator
+// can run days of refreshes in seconds. It is not set in the library
+// loaded by s3fs.
+//
+typedef int64_t (*S3fsClockFunc)();
+
+void S3fsSetVirtualClock(S3fsClockFunc clockfunc);
+int64_t S3fsGetCurrentTimeMs();
+int64_t S3fsGetMonotonicMs();
+bool S3fsIsExpiredWithin(const Aws::Auth::AWSCredentials& credentials, int64_t marginms);
+
+//----------------------------------------------------------
+// Deadline utilities
+//----------------------------------------------------------
+// [NOTE]
+// The deadline is the time(milliseconds of S3fsGetMonotonicMs) by which
+// one UpdateS3fsCredential call must be finished. 0 means no deadline.
+// It is not read from the wall clock, so a clock step(ex. NTP) during
+// the update does not shorten or extend the budget.
+//
+int64_t S3fsGetRemainingMs(int64_t deadline);
+Aws::Client::ClientConfiguration S3fsCreateClientConfiguration(int64_t deadline);
+
+//----------------------------------------------------------
+// Class S3fsDeadlineRetryStrategy
+//----------------------------------------------------------
+// [NOTE]
+// This is DefaultRetryStrategy, but it does not retry if the next
+// attempt would start after the deadline.
+//
+class S3fsDeadlineRetryStrategy : public Aws::Client::DefaultRetryStrategy
+{
+	private:
+		int64_t		deadline;
+
+	public:
+		S3fsDeadlineRetryStrategy(int64_t deadlinems, long maxRetries = 3);
+
+		bool ShouldRetry(const Aws::Client::AWSError<Aws::Client::CoreErrors>& error, long attemptedRetries) const override;
+};
 
 //----------------------------------------------------------
 // Class S3fsAWSCredentialsProviderChain
@@ -35,9 +124,275 @@
 //
 class S3fsAWSCredentialsProviderChain : public Aws::Auth::AWSCredentialsProviderChain
 {
+	private:
+		Aws::Vector<Aws::String>	providerNames;		// same order as providers in chain
+		int64_t						deadline;
+		bool						deadlineExceeded;
+
+	private:
+		void AddNamedProvider(const char* name, const std::shared_ptr<Aws::Auth::AWSCredentialsProvider>& provider);
+
+	public:
+		S3fsAWSCredentialsProviderChain(const char* ssoprofile = nullptr, const std::shared_ptr<Aws::Auth::AWSCredentialsProvider>& ssoprovider = nullptr, int64_t deadlinems = 0, const std::shared_ptr<Aws::Auth::AWSCredentialsProvider>& stsprovider = nullptr, const std::shared_ptr<Aws::Auth::AWSCredentialsProvider>& containerprovider = nullptr);
+
+		Aws::Auth::AWSCredentials GetAWSCredentials() override;
+		bool IsDeadlineExceeded() const { return deadlineExceeded; }
+};
+
+//----------------------------------------------------------
+// Class S3fsValidPeriod
+//----------------------------------------------------------
+// [NOTE]
+// This class limits the expiration of the session token to the valid
+// period(TokenPeriodSecond) from the first time the token is read.
+// The expiration is kept on the monotonic clock, and is converted to
+// the wall clock time at each call. So even if the wall clock is
+// stepped(ex. NTP), the remaining time does not change and all mounts
+// do not refresh at once.
+//
+class S3fsValidPeriod
+{
+	private:
+		Aws::String		targetSessionToken;
+		int64_t			targetExpirationMono;
+
+	public:
+		S3fsValidPeriod() : targetExpirationMono(0) {}
+
+		Aws::Utils::DateTime GetExpiration(int64_t periodsec, const Aws::String& sessionToken, const Aws::Utils::DateTime& exp);
+};
+
+//----------------------------------------------------------
+// Class S3fsCachedCredentialsProvider
+//----------------------------------------------------------
+// [NOTE]
+// Base class of the providers in this library which are kept while
+// the library is loaded and cache credentials.
+// The credentials are reloaded when they expire within the refresh
+// margin. The margin is the default of each provider, or the margin
+// requested by the caller(SetRefreshMargin) if it is longer, so that
+// the next credentials are fetched while the current ones are still
+// valid.
+// To avoid reloading on every call when the upstream can not return
+// credentials that satisfy the margin(or fails), valid credentials are
+// not reloaded again within S3FS_MIN_RELOAD_INTERVAL_MS.
+// If the refresh jitter is set(SetRefreshJitter), a random time up to
+// it is added to the margin for each credentials, so that the mounts
+// which got the same credentials do not refresh at the same time. The
+// jitter is limited to half of the lifetime of the credentials beyond
+// the margin.
+//
+class S3fsCachedCredentialsProvider : public Aws::Auth::AWSCredentialsProvider
+{
+	protected:
+		const char*					tag;
+		const int64_t				defaultMargin;
+		Aws::Auth::AWSCredentials	credentials;
+		std::atomic<int64_t>		deadline;
+		std::atomic<int64_t>		refreshMargin;
+		std::atomic<int64_t>		refreshJitter;
+		int64_t						currentJitter;		// jitter for the current credentials
+		int64_t						lastReloadMs;
+		std::minstd_rand			jitterRandom;
+
+	protected:
+		int64_t GetRefreshMargin() const;
+		bool IsCacheValid(int64_t margin) const;
+		void RefreshIfExpired();
+
 	public:
-		S3fsAWSCredentialsProviderChain(const char* ssoprofile = nullptr);
+		S3fsCachedCredentialsProvider(const char* tagname, int64_t defaultmarginms);
+
+		Aws::Auth::AWSCredentials GetAWSCredentials() override;
+		virtual bool IsConfigured() const { return true; }
+		void SetDeadline(int64_t deadlinems) { deadline = deadlinems; }
+		void SetRefreshMargin(int64_t marginms) { refreshMargin = marginms; }
+		void SetRefreshJitter(int64_t jitterms) { refreshJitter = jitterms; }
+};
+
+#ifdef S3FSAWSCRED_PROVIDER_SSO
+//----------------------------------------------------------
+// Class S3fsSSOCredentialsProvider
+//----------------------------------------------------------
+// [NOTE]
+// SSOCredentialsProvider in aws-sdk-cpp only uses the access token
+// in ~/.aws/sso/cache, so it can not get credentials after that
+// token has expired until the user logs in again.
+// This class refreshes the access token with the refresh token and
+// the client registration in the cache file, and caches the role
+// credentials(GetRoleCredentials result) until they expire.
+// This object is kept while the library is loaded, and it does not
+// access to the SSO portal while the cached credentials are valid.
+//
+class S3fsSSOCredentialsProvider : public S3fsCachedCredentialsProvider
+{
+	private:
+		Aws::String								profileName;
+		Aws::String								ssoSessionName;
+		Aws::String								ssoRegion;
+		Aws::String								ssoStartUrl;
+		Aws::String								ssoAccountId;
+		Aws::String								ssoRoleName;
+		Aws::String								cacheFilePath;
+		Aws::String								portalEndpoint;
+		Aws::String								oidcEndpoint;
+
+		Aws::String								accessToken;
+		Aws::Utils::DateTime					accessTokenExpiration;
+		Aws::String								refreshToken;
+		Aws::String								clientId;
+		Aws::String								clientSecret;
+		Aws::Utils::DateTime					registrationExpiration;
+
+		std::shared_ptr<Aws::Http::HttpClient>	httpClient;
+
+	protected:
+		void Reload() override;
+
+	private:
+		bool LoadProfile();
+		bool LoadTokenCache();
+		bool SaveTokenCache();
+		bool RefreshAccessToken();
+		bool GetRoleCredentials();
+		std::shared_ptr<Aws::Http::HttpClient> GetHttpClient() const;
+
+	public:
+		S3fsSSOCredentialsProvider(const char* ssoprofile, const char* portal = nullptr, const char* oidc = nullptr);
+};
+#endif
+
+#ifdef S3FSAWSCRED_PROVIDER_STS
+//----------------------------------------------------------
+// Class S3fsSTSEndpointSelector
+//----------------------------------------------------------
+// [NOTE]
+// This class keeps the list of STS endpoints and the moving averages
+// of the latency(successful requests only) and the error rate for each
+// endpoint.
+// GetOrder() returns the order to try endpoints:
+//   1) healthy endpoints whose last request did not fail, the endpoints
+//      not measured yet first, then the fastest first
+//   2) healthy endpoints whose last request failed, the fastest first
+//   3) unhealthy endpoints(high error rate), the oldest error first
+// An unhealthy endpoint becomes healthy again a while after its last
+// error, and it is ordered by 1) or 2) again(to check if it has
+// recovered).
+//
+class S3fsSTSEndpointSelector
+{
+	private:
+		typedef struct s3fs_sts_endpoint{
+			Aws::String	url;
+			Aws::String	region;
+			double		latencyMs;			// moving average, negative means not measured yet
+			double		errorRate;			// moving average(0.0 - 1.0)
+			int64_t		lastErrorMs;		// time of the last error(milliseconds from epoch)
+			bool		lastFailed;			// the last request failed
+		}S3FSSTSENDPOINT;
+
+		mutable std::mutex					lock;
+		Aws::Vector<S3FSSTSENDPOINT>		endpoints;
+
+	public:
+		explicit S3fsSTSEndpointSelector(const Aws::String& strEndpoints);
+
+		static Aws::String GetDefaultRegion();
+
+		size_t Size() const { return endpoints.size(); }
+		const Aws::String& GetUrl(size_t index) const { return endpoints[index].url; }
+		const Aws::String& GetRegion(size_t index) const { return endpoints[index].region; }
+
+		Aws::Vector<size_t> GetOrder() const;
+		void Report(size_t index, bool success, int64_t latencyms);
+};
+
+//----------------------------------------------------------
+// Class S3fsSTSCredentialsProvider
+//----------------------------------------------------------
+// [NOTE]
+// This provider gets credentials with AssumeRoleWithWebIdentity or
+// AssumeRole from the STS endpoints selected by S3fsSTSEndpointSelector,
+// and fails over to the next endpoint if the request fails.
+// This replaces STSAssumeRoleWebIdentityCredentialsProvider and
+// STSProfileCredentialsProvider in the chain when the STSEndpoints
+// option is specified, or when the DeadlineMs option is specified(with
+// the regional endpoint of the default region), because the clients of
+// those aws-sdk-cpp providers are not limited by the deadline.
+//
+// The parameters are read from the following:
+//   Web Identity : AWS_ROLE_ARN, AWS_WEB_IDENTITY_TOKEN_FILE and
+//                  AWS_ROLE_SESSION_NAME environments, or role_arn,
+//                  web_identity_token_file and role_session_name in
+//                  the profile.
+//   AssumeRole   : role_arn, source_profile, external_id and
+//                  role_session_name in the profile. The credentials
+//                  of the source profile are used to sign requests.
+//
+class S3fsSTSCredentialsProvider : public S3fsCachedCredentialsProvider
+{
+	private:
+		std::shared_ptr<S3fsSTSEndpointSelector>					selector;
+		Aws::String													roleArn;
+		Aws::String													sessionName;
+		Aws::String													tokenFile;
+		Aws::String													externalId;
+		std::shared_ptr<Aws::Auth::AWSCredentialsProvider>			sourceProvider;		// AssumeRole only
+
+	protected:
+		void Reload() override;
+
+	private:
+		bool IsWebIdentity() const { return !tokenFile.empty(); }
+		bool RequestCredentials(size_t index, const Aws::String& payload);
+
+	public:
+		S3fsSTSCredentialsProvider(const std::shared_ptr<S3fsSTSEndpointSelector>& endpointselector);
+
+		bool IsConfigured() const override { return !roleArn.empty() && (IsWebIdentity() || sourceProvider); }
+};
+#endif
+
+#ifdef S3FSAWSCRED_PROVIDER_CONTAINER
+//----------------------------------------------------------
+// Class S3fsContainerCredentialsProvider
+//----------------------------------------------------------
+// [NOTE]
+// This provider gets credentials from the container credentials
+// endpoint(ECS task role or EKS Pod Identity agent), and caches them
+// until shortly before they expire.
+// The endpoint is AWS_CONTAINER_CREDENTIALS_RELATIVE_URI(with ECS
+// endpoint) or AWS_CONTAINER_CREDENTIALS_FULL_URI, and the
+// authorization token is AWS_CONTAINER_AUTHORIZATION_TOKEN_FILE or
+// AWS_CONTAINER_AUTHORIZATION_TOKEN.
+// The token file is rotated(ex. by kubelet), so it is read again
+// only when it has been changed(inode, size or modification time).
+//
+class S3fsContainerCredentialsProvider : public S3fsCachedCredentialsProvider
+{
+	private:
+		Aws::String					endpoint;
+		Aws::String					tokenFile;
+		Aws::String					token;				// from AWS_CONTAINER_AUTHORIZATION_TOKEN or token file
+		ino_t						tokenFileIno;
+		off_t						tokenFileSize;
+		struct timespec				tokenFileMtime;
+
+	protected:
+		void Reload() override;
+
+	private:
+		bool LoadTokenFile(bool force);
+		bool RequestCredentials(bool& isAuthError);
+
+	public:
+		S3fsContainerCredentialsProvider(const char* relativeUri, const char* absoluteUri);
+
+		static bool IsValidEndpoint(const Aws::String& url);
+
+		bool IsConfigured() const override { return !endpoint.empty(); }
 };
+#endif
 
 /*
  * Local variables:
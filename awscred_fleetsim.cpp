@@ -0,0 +1,785 @@
+/*
+ * s3fs-fuse-awscred-lib ( s3fs-fuse credential I/F library for AWS )
+ *
+ *     Copyright 2022 Takeshi Nakatani <ggtakec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//-------------------------------------------------------------------
+// [NOTE] About this program
+//-------------------------------------------------------------------
+// This program simulates a fleet of s3fs mounts on a virtual clock to
+// evaluate the options of this library which change the refresh timing
+// (MinValidSecond, RefreshJitterSecond and TokenPeriodSecond):
+//   - Each mount has its own state which is the same as the library
+//     loaded by one s3fs process: the cached credentials provider of
+//     the upstream, the valid period of the session token and the
+//     prefetch(MinValidSecond). It is updated in the same way as
+//     UpdateS3fsCredential, which is called before each request when
+//     the held credentials expire within the client margin.
+//   - The upstream is a local stand-in endpoint on the loopback
+//     address, which issues new credentials for each request:
+//       container : Container credentials endpoint(AWS_CONTAINER_CREDENTIALS_FULL_URI)
+//       sts       : STS endpoint for AssumeRoleWithWebIdentity(same as
+//                   STSEndpoints option and AWS_WEB_IDENTITY_TOKEN_FILE)
+//   - The library and the stand-in read the virtual clock
+//     (S3fsSetVirtualClock), so days of traffic are simulated in
+//     seconds.
+//
+// The library is initialized once(InitS3fsCredential) for aws-sdk-cpp.
+// The virtual clock advances by one second at a time, and the mounts
+// which make a request in that second are processed concurrently by
+// the worker threads, so the refreshes of the mounts at the same time
+// reach the stand-in together. The upstream requests are counted for
+// each virtual second across all mounts.
+//
+// For each policy, it reports the number of updates, the upstream
+// requests(average rate, peak per second and per minute), the errors
+// and the stale credential incidents(a request was made with expired
+// credentials).
+//
+// Usage: s3fsawscred_fleetsim [options] [--policy <policy>]...
+//   --mounts <count>             Number of mounts(default: 100)
+//   --days <days>                Simulated days(default: 1)
+//   --step <sec>                 Request interval of each mount(default: 10)
+//   --ramp <sec>                 Mounts start within this time(default: 3600)
+//   --upstream <container|sts>   Upstream type(default: container)
+//   --lifetime <sec>             Lifetime of credentials(default: container 21600, sts 3600)
+//   --failure <rate>             Failure rate of upstream requests(default: 0)
+//   --seed <number>              Random seed(default: 1)
+//   --threads <count>            Worker threads for the mounts(default: 16)
+//   --policy <policy>            Policy to evaluate(can be specified multiple times)
+//                                "margin=<sec>,jitter=<sec>,period=<sec>,client=<sec>"
+//                                  margin : MinValidSecond, the refresh margin of
+//                                           the cached credentials and the prefetch
+//                                           (default: 0 = not set)
+//                                  jitter : RefreshJitterSecond(default: 0)
+//                                  period : TokenPeriodSecond(default: 0 = not set)
+//                                  client : Client margin of s3fs(default: 1200)
+//
+// [NOTE]
+// This program does not use ~/.aws and the credential environments of
+// the caller, so it can be run on any host without AWS.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "awscred.h"
+#include "awscred_func.h"
+#include "awscred_standin.h"
+
+//-------------------------------------------------------------------
+// Virtual clock
+//-------------------------------------------------------------------
+// [NOTE]
+// The simulation starts at a fixed time, so the results are the same
+// for the same options(except for the refresh jitter).
+// The clock is set by the main thread for each virtual second, and is
+// read by the worker threads and the stand-in endpoint thread.
+//
+static const int64_t			SIM_START_MS = 1700000000000LL;
+static std::atomic<int64_t>		simNowMs(SIM_START_MS);
+
+static int64_t GetSimulatedTimeMs()
+{
+	return simNowMs.load(std::memory_order_relaxed);
+}
+
+//-------------------------------------------------------------------
+// Options and policies
+//-------------------------------------------------------------------
+typedef struct sim_policy{
+	std::string	name;
+	int64_t		marginsec;
+	int64_t		jittersec;
+	int64_t		periodsec;
+	int64_t		clientsec;
+
+	sim_policy() : marginsec(0), jittersec(0), periodsec(0), clientsec(1200) {}
+}SIMPOLICY;
+
+typedef struct sim_options{
+	int						mounts;
+	int						days;
+	int						step;
+	int						ramp;
+	bool					isSTS;
+	int64_t					lifetime;
+	double					failure;
+	unsigned int			seed;
+	int						threads;
+	std::vector<SIMPOLICY>	policies;
+
+	sim_options() : mounts(100), days(1), step(10), ramp(3600), isSTS(false), lifetime(-1), failure(0.0), seed(1), threads(16) {}
+}SIMOPTIONS;
+
+static void PrintUsage(const char* prgname)
+{
+	std::cout << "Usage: " << prgname << " [options] [--policy <policy>]..."												<< std::endl;
+	std::cout << "  --mounts <count>             Number of mounts(default: 100)"										<< std::endl;
+	std::cout << "  --days <days>                Simulated days(default: 1)"											<< std::endl;
+	std::cout << "  --step <sec>                 Request interval of each mount(default: 10)"							<< std::endl;
+	std::cout << "  --ramp <sec>                 Mounts start within this time(default: 3600)"							<< std::endl;
+	std::cout << "  --upstream <container|sts>   Upstream type(default: container)"										<< std::endl;
+	std::cout << "  --lifetime <sec>             Lifetime of credentials(default: container 21600, sts 3600)"			<< std::endl;
+	std::cout << "  --failure <rate>             Failure rate of upstream requests(default: 0)"							<< std::endl;
+	std::cout << "  --seed <number>              Random seed(default: 1)"												<< std::endl;
+	std::cout << "  --threads <count>            Worker threads for the mounts(default: 16)"							<< std::endl;
+	std::cout << "  --policy <policy>            \"margin=<sec>,jitter=<sec>,period=<sec>,client=<sec>\""				<< std::endl;
+	std::cout << "                                 margin : MinValidSecond(default: 0 = not set)"						<< std::endl;
+	std::cout << "                                 jitter : RefreshJitterSecond(default: 0)"							<< std::endl;
+	std::cout << "                                 period : TokenPeriodSecond(default: 0 = not set)"					<< std::endl;
+	std::cout << "                                 client : Client margin of s3fs(default: 1200)"						<< std::endl;
+}
+
+static bool ParsePolicy(const char* value, SIMPOLICY& policy)
+{
+	std::stringstream	ss(value);
+	std::string			item;
+
+	policy		= SIMPOLICY();
+	policy.name	= value;
+	while(std::getline(ss, item, ',')){
+		std::string::size_type	pos = item.find('=');
+		if(std::string::npos == pos){
+			std::cerr << "[ERROR] Wrong policy item(" << item << ")." << std::endl;
+			return false;
+		}
+		std::string	key		= item.substr(0, pos);
+		int64_t		number	= strtoll(item.c_str() + pos + 1, NULL, 10);
+		if(number < 0){
+			std::cerr << "[ERROR] Policy value must not be negative(" << item << ")." << std::endl;
+			return false;
+		}
+		if("margin" == key){
+			policy.marginsec = number;
+		}else if("jitter" == key){
+			policy.jittersec = number;
+		}else if("period" == key){
+			policy.periodsec = number;
+		}else if("client" == key){
+			policy.clientsec = number;
+		}else{
+			std::cerr << "[ERROR] Unknown policy item(" << item << ")." << std::endl;
+			return false;
+		}
+	}
+
+	// Same as InitS3fsCredential
+	if(0 < policy.marginsec && 0 < policy.periodsec && policy.periodsec <= policy.marginsec){
+		std::cerr << "[ERROR] Policy margin must be less than period(" << value << ")." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static bool ParseOptions(int argc, char** argv, SIMOPTIONS& opts)
+{
+	for(int cnt = 1; cnt < argc; ++cnt){
+		if(0 == strcmp(argv[cnt], "-h") || 0 == strcmp(argv[cnt], "--help")){
+			return false;
+		}
+		if((cnt + 1) >= argc){
+			std::cerr << "[ERROR] Option(" << argv[cnt] << ") needs a value." << std::endl;
+			return false;
+		}
+		const char*	option	= argv[cnt];
+		const char*	value	= argv[++cnt];
+
+		if(0 == strcmp(option, "--mounts")){
+			opts.mounts = atoi(value);
+		}else if(0 == strcmp(option, "--days")){
+			opts.days = atoi(value);
+		}else if(0 == strcmp(option, "--step")){
+			opts.step = atoi(value);
+		}else if(0 == strcmp(option, "--ramp")){
+			opts.ramp = atoi(value);
+		}else if(0 == strcmp(option, "--upstream")){
+			if(0 == strcasecmp(value, "sts")){
+				opts.isSTS = true;
+			}else if(0 == strcasecmp(value, "container")){
+				opts.isSTS = false;
+			}else{
+				std::cerr << "[ERROR] Unknown upstream(" << value << ") is specified." << std::endl;
+				return false;
+			}
+		}else if(0 == strcmp(option, "--lifetime")){
+			opts.lifetime = strtoll(value, NULL, 10);
+		}else if(0 == strcmp(option, "--failure")){
+			opts.failure = strtod(value, NULL);
+		}else if(0 == strcmp(option, "--seed")){
+			opts.seed = static_cast<unsigned int>(strtoul(value, NULL, 10));
+		}else if(0 == strcmp(option, "--threads")){
+			opts.threads = atoi(value);
+		}else if(0 == strcmp(option, "--policy")){
+			SIMPOLICY	policy;
+			if(!ParsePolicy(value, policy)){
+				return false;
+			}
+			opts.policies.push_back(policy);
+		}else{
+			std::cerr << "[ERROR] Unknown option(" << option << ") is specified." << std::endl;
+			return false;
+		}
+	}
+	if(-1 == opts.lifetime){
+		opts.lifetime = opts.isSTS ? 3600 : 21600;
+	}
+	if(opts.mounts <= 0 || opts.days <= 0 || opts.step <= 0 || opts.ramp < 0 || opts.threads <= 0 || opts.lifetime <= 0 || opts.failure < 0.0 || 1.0 < opts.failure){
+		std::cerr << "[ERROR] Option values are out of range." << std::endl;
+		return false;
+	}
+	if(opts.policies.empty()){
+		const char*	defaults[] = {"client=1200", "client=1200,jitter=600", "client=1200,period=900", "client=1200,margin=1500"};
+		for(size_t cnt = 0; cnt < sizeof(defaults) / sizeof(defaults[0]); ++cnt){
+			SIMPOLICY	policy;
+			ParsePolicy(defaults[cnt], policy);
+			opts.policies.push_back(policy);
+		}
+	}
+	return true;
+}
+
+//-------------------------------------------------------------------
+// Local stand-in endpoint
+//-------------------------------------------------------------------
+// [NOTE]
+// This is the shared stand-in endpoint(awscred_standin.h) which issues
+// new credentials for each request which expire after the lifetime on
+// the virtual clock, or fails with the failure rate.
+// It counts the requests for each virtual second, and keeps the real
+// expiration of the issued credentials to detect the stale credentials.
+//
+class SimEndpoint
+{
+	private:
+		const SIMOPTIONS&						opts;
+		std::mutex								lock;
+		std::mt19937							random;
+		std::uniform_real_distribution<double>	failureDist;
+		uint64_t								issueSerial;
+		std::vector<uint32_t>					requestsPerSec;
+		uint64_t								requests;
+		std::map<std::string, int64_t>			issued;				// access key id -> expiration
+		S3fsStandinEndpoint						endpoint;
+
+	private:
+		void HandleRequest(const S3FSSTANDINREQ& req, S3FSSTANDINRES& res);
+
+	public:
+		SimEndpoint(const SIMOPTIONS& options) : opts(options), random(options.seed), failureDist(0.0, 1.0), issueSerial(0), requestsPerSec(static_cast<size_t>(options.days) * 24 * 60 * 60 + 1, 0), requests(0), endpoint(std::bind(&SimEndpoint::HandleRequest, this, std::placeholders::_1, std::placeholders::_2)) {}
+
+		bool Start() { return endpoint.Start(); }
+		void Stop() { endpoint.Stop(); }
+		void Reset();
+
+		int GetPort() const { return endpoint.GetPort(); }
+		int64_t GetExpiration(const char* accesskey);
+		uint64_t GetRequests();
+		uint32_t GetPeakPerSec();
+		uint32_t GetPeakPerMin();
+};
+
+//
+// Reset the counters and the random sequence for the next policy
+//
+void SimEndpoint::Reset()
+{
+	std::lock_guard<std::mutex>	guard(lock);
+	random.seed(opts.seed);
+	issueSerial	= 0;
+	requests	= 0;
+	std::fill(requestsPerSec.begin(), requestsPerSec.end(), 0);
+	issued.clear();
+}
+
+int64_t SimEndpoint::GetExpiration(const char* accesskey)
+{
+	std::lock_guard<std::mutex>	guard(lock);
+	std::map<std::string, int64_t>::const_iterator	iter = issued.find(accesskey ? accesskey : "");
+	return (issued.end() == iter) ? 0 : iter->second;
+}
+
+uint64_t SimEndpoint::GetRequests()
+{
+	std::lock_guard<std::mutex>	guard(lock);
+	return requests;
+}
+
+uint32_t SimEndpoint::GetPeakPerSec()
+{
+	std::lock_guard<std::mutex>	guard(lock);
+	return *std::max_element(requestsPerSec.begin(), requestsPerSec.end());
+}
+
+uint32_t SimEndpoint::GetPeakPerMin()
+{
+	std::lock_guard<std::mutex>	guard(lock);
+	uint32_t	peak	= 0;
+	uint32_t	window	= 0;
+	for(size_t cnt = 0; cnt < requestsPerSec.size(); ++cnt){
+		window += requestsPerSec[cnt];
+		if(60 <= cnt){
+			window -= requestsPerSec[cnt - 60];
+		}
+		peak = std::max(peak, window);
+	}
+	return peak;
+}
+
+void SimEndpoint::HandleRequest(const S3FSSTANDINREQ& req, S3FSSTANDINRES& res)
+{
+	std::lock_guard<std::mutex>	guard(lock);
+
+	int64_t	nowms	= simNowMs.load(std::memory_order_relaxed);
+	size_t	index	= static_cast<size_t>((nowms - SIM_START_MS) / 1000);
+	if(index < requestsPerSec.size()){
+		++requestsPerSec[index];
+	}
+	++requests;
+
+	if(0.0 < opts.failure && failureDist(random) < opts.failure){
+		res.status = 500;
+		return;
+	}
+
+	std::ostringstream	accesskey;
+	++issueSerial;
+	accesskey << "ASIASIM" << std::setw(12) << std::setfill('0') << issueSerial;
+
+	// The expiration has seconds precision in the response
+	time_t	expiration	= static_cast<time_t>((nowms / 1000) + opts.lifetime);
+	issued[accesskey.str()] = static_cast<int64_t>(expiration) * 1000;
+
+	std::ostringstream	body;
+	if(opts.isSTS){
+		body << "<AssumeRoleWithWebIdentityResponse xmlns=\"https://sts.amazonaws.com/doc/2011-06-15/\"><AssumeRoleWithWebIdentityResult><Credentials>";
+		body << "<AccessKeyId>" << accesskey.str() << "</AccessKeyId>";
+		body << "<SecretAccessKey>simulated-secret</SecretAccessKey>";
+		body << "<SessionToken>simulated-session-token-" << issueSerial << "</SessionToken>";
+		body << "<Expiration>" << S3fsStandinFormatIso8601(expiration) << "</Expiration>";
+		body << "</Credentials></AssumeRoleWithWebIdentityResult></AssumeRoleWithWebIdentityResponse>";
+		res.contentType = "text/xml";
+	}else{
+		body << "{\"AccessKeyId\":\"" << accesskey.str() << "\",\"SecretAccessKey\":\"simulated-secret\",\"Token\":\"simulated-session-token-" << issueSerial << "\",\"Expiration\":\"" << S3fsStandinFormatIso8601(expiration) << "\"}";
+	}
+	res.status	= 200;
+	res.body	= body.str();
+}
+
+//-------------------------------------------------------------------
+// Environments
+//-------------------------------------------------------------------
+// [NOTE]
+// Only the stand-in endpoint must be used, so the other credentials
+// (environments, ~/.aws, EC2 metadata) are disabled.
+//
+static bool SetupEnvironments(const SIMOPTIONS& opts, const std::string& tmpdir, int port)
+{
+	S3fsStandinResetEnvironments(tmpdir);
+
+	if(opts.isSTS){
+		std::string		tokenfile = tmpdir + "/token";
+		std::ofstream	out(tokenfile.c_str(), std::ios::out | std::ios::trunc);
+		if(!out){
+			std::cerr << "[ERROR] Could not write token file " << tokenfile << std::endl;
+			return false;
+		}
+		out << "simulated-web-identity-token" << std::endl;
+
+		setenv("AWS_ROLE_ARN",					"arn:aws:iam::123456789012:role/s3fsawscred-fleetsim",	1);
+		setenv("AWS_WEB_IDENTITY_TOKEN_FILE",	tokenfile.c_str(),										1);
+		setenv("AWS_ROLE_SESSION_NAME",			"s3fsawscred-fleetsim",									1);
+	}else{
+		std::ostringstream	url;
+		url << "http://127.0.0.1:" << port << "/v1/credentials";
+		setenv("AWS_CONTAINER_CREDENTIALS_FULL_URI", url.str().c_str(), 1);
+	}
+	return true;
+}
+
+//-------------------------------------------------------------------
+// Simulation
+//-------------------------------------------------------------------
+typedef struct sim_result{
+	uint64_t	clientRequests;
+	uint64_t	updates;
+	uint64_t	errors;
+	uint64_t	upstreamRequests;
+	uint32_t	peakPerSec;
+	uint32_t	peakPerMin;
+	uint64_t	stales;
+
+	sim_result() : clientRequests(0), updates(0), errors(0), upstreamRequests(0), peakPerSec(0), peakPerMin(0), stales(0) {}
+}SIMRESULT;
+
+//
+// State of one mount
+//
+// [NOTE]
+// The provider, the valid period and the prefetch are the same as the
+// library loaded by one s3fs process(S3fsAwsCredLoad, the valid period
+// of the session token and S3fsAwsCredAsyncPrefetch in awscred_func.cpp).
+// The held credentials are the ones s3fs keeps until they expire
+// within the client margin.
+//
+typedef struct sim_mount{
+	std::shared_ptr<S3fsCachedCredentialsProvider>	provider;
+	S3fsValidPeriod									validPeriod;
+	int64_t											currentExpiration;		// expiration of the current credentials(prefetch)
+	int64_t											currentLifetime;		// lifetime of the current credentials(prefetch)
+	int64_t											prefetchedExpiration;	// expiration of the credentials which were prefetched
+	bool											held;
+	int64_t											heldExpiration;			// returned to s3fs(TokenPeriodSecond applied)
+	int64_t											heldRealExpiration;		// expiration by the upstream
+	SIMRESULT										result;
+
+	sim_mount() : currentExpiration(0), currentLifetime(0), prefetchedExpiration(0), held(false), heldExpiration(0), heldRealExpiration(0) {}
+}SIMMOUNT;
+
+//
+// Create the provider of a mount in the same way as S3fsAwsCredLoad
+//
+static std::shared_ptr<S3fsCachedCredentialsProvider> CreateMountProvider(const SIMOPTIONS& opts, int port)
+{
+	std::shared_ptr<S3fsCachedCredentialsProvider>	provider;
+	if(opts.isSTS){
+		std::ostringstream	endpoints;
+		endpoints << "http://127.0.0.1:" << port;
+		auto	selector	= Aws::MakeShared<S3fsSTSEndpointSelector>("S3fsSTSEndpointSelector", endpoints.str().c_str());
+		provider			= Aws::MakeShared<S3fsSTSCredentialsProvider>("S3fsSTSCredentialsProvider", selector);
+	}else{
+		const auto	relativeUri = Aws::Environment::GetEnv("AWS_CONTAINER_CREDENTIALS_RELATIVE_URI");
+		const auto	absoluteUri = Aws::Environment::GetEnv("AWS_CONTAINER_CREDENTIALS_FULL_URI");
+		provider			= Aws::MakeShared<S3fsContainerCredentialsProvider>("S3fsContainerCredentialsProvider", relativeUri.c_str(), absoluteUri.c_str());
+	}
+	if(!provider->IsConfigured()){
+		return std::shared_ptr<S3fsCachedCredentialsProvider>();
+	}
+	return provider;
+}
+
+//
+// Get credentials of a mount with the refresh margin
+//
+static Aws::Auth::AWSCredentials LoadMountCredentials(const SIMPOLICY& policy, SIMMOUNT& mount, int64_t marginms)
+{
+	mount.provider->SetRefreshMargin(marginms);
+	mount.provider->SetRefreshJitter(policy.jittersec * 1000);
+	return mount.provider->GetAWSCredentials();
+}
+
+//
+// Make one request of a mount at the current virtual time
+//
+// [NOTE]
+// This is the same as UpdateS3fsCredential called by s3fs before each
+// request. The prefetch of the library is processed by its worker
+// thread, but it is processed here in the same virtual second.
+//
+static void RunMountRequest(const SIMPOLICY& policy, SimEndpoint& endpoint, SIMMOUNT& mount)
+{
+	int64_t	nowms		= S3fsGetCurrentTimeMs();
+	int64_t	minvalidms	= policy.marginsec * 1000;
+
+	++mount.result.clientRequests;
+
+	// Same as s3fs, update credentials which expire within the client margin
+	if(!mount.held || (mount.heldExpiration - nowms) <= policy.clientsec * 1000){
+		++mount.result.updates;
+
+		Aws::Auth::AWSCredentials	credentials = LoadMountCredentials(policy, mount, minvalidms);
+		if(!credentials.GetAWSAccessKeyId().empty() && !credentials.GetAWSSecretKey().empty()){
+			Aws::Utils::DateTime	expiration = credentials.GetExpiration();
+			if(0 < policy.periodsec){
+				expiration = mount.validPeriod.GetExpiration(policy.periodsec, credentials.GetSessionToken(), expiration);
+			}
+			mount.held					= true;
+			mount.heldExpiration		= expiration.Millis();
+			mount.heldRealExpiration	= endpoint.GetExpiration(credentials.GetAWSAccessKeyId().c_str());
+
+			// Prefetch the next credentials(once for each credentials)
+			if(0 < minvalidms){
+				if(mount.currentExpiration != mount.heldExpiration){
+					mount.currentExpiration	= mount.heldExpiration;
+					mount.currentLifetime	= std::max<int64_t>(0, mount.heldExpiration - nowms);
+				}
+				int64_t	prefetchms = std::min(minvalidms * 2, mount.currentLifetime / 2);
+				if((mount.heldExpiration - nowms) < prefetchms && mount.prefetchedExpiration != mount.heldExpiration){
+					mount.prefetchedExpiration = mount.heldExpiration;
+					LoadMountCredentials(policy, mount, prefetchms);
+				}
+			}
+		}else{
+			++mount.result.errors;
+		}
+	}
+	if(!mount.held || mount.heldRealExpiration <= nowms){
+		++mount.result.stales;
+	}
+}
+
+//-------------------------------------------------------------------
+// Class SimWorkers
+//-------------------------------------------------------------------
+// [NOTE]
+// The worker threads process the mounts which make a request in the
+// current virtual second, and Run() returns when all of them have been
+// processed, then the main thread advances the virtual clock.
+//
+class SimWorkers
+{
+	private:
+		const SIMPOLICY*			policy;
+		SimEndpoint&				endpoint;
+		std::vector<SIMMOUNT>*		mounts;
+		std::vector<size_t>			due;
+		std::atomic<size_t>			next;
+		std::mutex					lock;
+		std::condition_variable		startCond;
+		std::condition_variable		doneCond;
+		uint64_t					generation;
+		int							running;
+		bool						stopping;
+		std::vector<std::thread>	threads;
+
+	private:
+		void WorkerProc();
+
+	public:
+		SimWorkers(SimEndpoint& simendpoint, int count);
+		~SimWorkers();
+
+		void Run(const SIMPOLICY& simpolicy, std::vector<SIMMOUNT>& simmounts, const std::vector<size_t>& indexes);
+};
+
+SimWorkers::SimWorkers(SimEndpoint& simendpoint, int count) : policy(NULL), endpoint(simendpoint), mounts(NULL), next(0), generation(0), running(0), stopping(false)
+{
+	for(int cnt = 0; cnt < count; ++cnt){
+		threads.push_back(std::thread(&SimWorkers::WorkerProc, this));
+	}
+}
+
+SimWorkers::~SimWorkers()
+{
+	{
+		std::lock_guard<std::mutex>	guard(lock);
+		stopping = true;
+	}
+	startCond.notify_all();
+	for(std::vector<std::thread>::iterator iter = threads.begin(); iter != threads.end(); ++iter){
+		iter->join();
+	}
+}
+
+void SimWorkers::Run(const SIMPOLICY& simpolicy, std::vector<SIMMOUNT>& simmounts, const std::vector<size_t>& indexes)
+{
+	std::unique_lock<std::mutex>	guard(lock);
+	policy	= &simpolicy;
+	mounts	= &simmounts;
+	due		= indexes;
+	next.store(0);
+	running	= static_cast<int>(threads.size());
+	++generation;
+	startCond.notify_all();
+
+	doneCond.wait(guard, [this]{ return (0 == running); });
+}
+
+void SimWorkers::WorkerProc()
+{
+	uint64_t	lastgeneration = 0;
+	while(true){
+		{
+			std::unique_lock<std::mutex>	guard(lock);
+			startCond.wait(guard, [this, lastgeneration]{ return (stopping || lastgeneration != generation); });
+			if(stopping){
+				break;
+			}
+			lastgeneration = generation;
+		}
+
+		size_t	index;
+		while((index = next.fetch_add(1)) < due.size()){
+			RunMountRequest(*policy, endpoint, (*mounts)[due[index]]);
+		}
+
+		std::lock_guard<std::mutex>	guard(lock);
+		if(0 == --running){
+			doneCond.notify_one();
+		}
+	}
+}
+
+//
+// Run one policy
+//
+// [NOTE]
+// Each mount makes a request every step seconds from its start time.
+// The schedule has the next request time(virtual seconds) of each
+// mount, and the virtual clock jumps to the next second which has
+// requests.
+//
+static bool RunPolicy(const SIMOPTIONS& opts, const SIMPOLICY& policy, SimEndpoint& endpoint, SimWorkers& workers, SIMRESULT& result)
+{
+	typedef std::pair<int64_t, size_t>	schedule_t;		// virtual second, mount
+
+	std::mt19937							random(opts.seed);
+	std::uniform_int_distribution<int64_t>	startDist(0, std::max<int64_t>(0, static_cast<int64_t>(opts.ramp) - 1));
+	int64_t									durationsec = static_cast<int64_t>(opts.days) * 24 * 60 * 60;
+
+	endpoint.Reset();
+	simNowMs.store(SIM_START_MS);
+
+	std::vector<SIMMOUNT>	mounts(static_cast<size_t>(opts.mounts));
+	std::priority_queue<schedule_t, std::vector<schedule_t>, std::greater<schedule_t> >	schedule;
+	for(size_t cnt = 0; cnt < mounts.size(); ++cnt){
+		if(!(mounts[cnt].provider = CreateMountProvider(opts, endpoint.GetPort()))){
+			std::cerr << "[ERROR] Could not create the credentials provider of mounts." << std::endl;
+			return false;
+		}
+		schedule.push(schedule_t(startDist(random), cnt));
+	}
+
+	std::vector<size_t>	due;
+	while(!schedule.empty() && schedule.top().first < durationsec){
+		int64_t	sec = schedule.top().first;
+		due.clear();
+		while(!schedule.empty() && sec == schedule.top().first){
+			due.push_back(schedule.top().second);
+			schedule.pop();
+			schedule.push(schedule_t(sec + opts.step, due.back()));
+		}
+		simNowMs.store(SIM_START_MS + sec * 1000);
+		workers.Run(policy, mounts, due);
+	}
+
+	result = SIMRESULT();
+	for(std::vector<SIMMOUNT>::const_iterator iter = mounts.begin(); iter != mounts.end(); ++iter){
+		result.clientRequests	+= iter->result.clientRequests;
+		result.updates			+= iter->result.updates;
+		result.errors			+= iter->result.errors;
+		result.stales			+= iter->result.stales;
+	}
+	result.upstreamRequests	= endpoint.GetRequests();
+	result.peakPerSec		= endpoint.GetPeakPerSec();
+	result.peakPerMin		= endpoint.GetPeakPerMin();
+
+	return true;
+}
+
+//-------------------------------------------------------------------
+// Main
+//-------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	SIMOPTIONS	opts;
+	if(!ParseOptions(argc, argv, opts)){
+		PrintUsage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	// Temporary directory for the token file and the empty aws config
+	char	tmpdirbuff[] = "/tmp/s3fsawscred_fleetsim.XXXXXX";
+	if(!mkdtemp(tmpdirbuff)){
+		std::cerr << "[ERROR] Could not create temporary directory : errno=" << errno << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::string	tmpdir = tmpdirbuff;
+
+	SimEndpoint	endpoint(opts);
+	if(!endpoint.Start() || !SetupEnvironments(opts, tmpdir, endpoint.GetPort())){
+		endpoint.Stop();
+		unlink((tmpdir + "/token").c_str());
+		rmdir(tmpdir.c_str());
+		exit(EXIT_FAILURE);
+	}
+	S3fsSetVirtualClock(GetSimulatedTimeMs);
+
+	// Initialize the library only once(for aws-sdk-cpp)
+	char*	perrstr = NULL;
+	if(!InitS3fsCredential("Off", &perrstr)){
+		std::cerr << "[ERROR] Could not initialize library : " << (perrstr ? perrstr : "unknown") << std::endl;
+		free(perrstr);
+		S3fsSetVirtualClock(nullptr);
+		endpoint.Stop();
+		unlink((tmpdir + "/token").c_str());
+		rmdir(tmpdir.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	std::cout << "[s3fsawscred_fleetsim] " << VersionS3fsCredential(false) << std::endl;
+	std::cout << "  Upstream = " << (opts.isSTS ? "sts" : "container") << ", Lifetime = " << opts.lifetime << "s, Failure rate = " << opts.failure << std::endl;
+	std::cout << "  Mounts = " << opts.mounts << ", Days = " << opts.days << ", Step = " << opts.step << "s, Ramp = " << opts.ramp << "s, Threads = " << opts.threads << std::endl;
+	std::cout << std::endl;
+	std::cout << "  " << std::left << std::setw(40) << "policy" << std::right << " " << std::setw(12) << "updates" << " " << std::setw(10) << "upstream" << " " << std::setw(10) << "req/hour" << " " << std::setw(8) << "peak/s" << " " << std::setw(8) << "peak/min" << " " << std::setw(8) << "errors" << " " << std::setw(8) << "stale" << std::endl;
+
+	bool	failed	= false;
+	double	hours	= static_cast<double>(opts.days) * 24;
+	{
+		SimWorkers	workers(endpoint, opts.threads);
+		for(std::vector<SIMPOLICY>::const_iterator iter = opts.policies.begin(); iter != opts.policies.end(); ++iter){
+			SIMRESULT	result;
+			if(!RunPolicy(opts, *iter, endpoint, workers, result)){
+				failed = true;
+				break;
+			}
+
+			std::cout << "  " << std::left << std::setw(40) << iter->name << std::right;
+			std::cout << " " << std::setw(12) << result.updates << " " << std::setw(10) << result.upstreamRequests;
+			std::cout << " " << std::setw(10) << std::fixed << std::setprecision(1) << (static_cast<double>(result.upstreamRequests) / hours);
+			std::cout << " " << std::setw(8) << result.peakPerSec << " " << std::setw(8) << result.peakPerMin << " " << std::setw(8) << result.errors << " " << std::setw(8) << result.stales << std::endl;
+		}
+	}
+
+	if(!FreeS3fsCredential(&perrstr)){
+		std::cerr << "[ERROR] Could not uninitialize library : " << (perrstr ? perrstr : "unknown") << std::endl;
+		free(perrstr);
+		failed = true;
+	}
+	S3fsSetVirtualClock(nullptr);
+	endpoint.Stop();
+	unlink((tmpdir + "/token").c_str());
+	rmdir(tmpdir.c_str());
+
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noexpandtab sw=4 ts=4 fdm=marker
+ * vim<600: noexpandtab sw=4 ts=4
+ */
@@ -16,14 +16,35 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <iostream>
 #include <algorithm>
 #include <string>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
 
 #include "config.h"
 #include "awscred.h"
+#include "awscred_probe.h"
+
+// [NOTE]
+// The export functions must be visible even if this library is built
+// with -fvisibility=hidden(USE_SLIM_BUILD).
+//
+#pragma GCC visibility push(default)
 #include "awscred_func.h"
+#pragma GCC visibility pop
+
+//----------------------------------------------------------
+// Symbols
+//----------------------------------------------------------
+static const char S3fsAwsCredTag[]	= "S3fsAwsCred";
 
 //----------------------------------------------------------
 // S3fsAwsCredParseOption
@@ -156,6 +177,213 @@ static Aws::String& GetSSOProfile()
 	return ssoprofile;
 }
 
+//----------------------------------------------------------
+// SSO endpoints
+//----------------------------------------------------------
+// [NOTE]
+// These are used to override the SSO portal and SSO OIDC
+// endpoints, mainly for testing with a local stand-in server.
+//
+static Aws::String& GetSSOPortalEndpoint()
+{
+	static Aws::String	ssoportal;
+	return ssoportal;
+}
+
+static Aws::String& GetSSOOIDCEndpoint()
+{
+	static Aws::String	ssooidc;
+	return ssooidc;
+}
+
+//----------------------------------------------------------
+// SSO Credentials Provider
+//----------------------------------------------------------
+// [NOTE]
+// This provider caches the access token and role credentials,
+// so it is kept until FreeS3fsCredential is called.
+// It is created at the first UpdateS3fsCredential call after
+// Aws::InitAPI() was called.
+//
+#ifdef S3FSAWSCRED_PROVIDER_SSO
+static std::shared_ptr<S3fsSSOCredentialsProvider>& GetSSOProvider()
+{
+	static std::shared_ptr<S3fsSSOCredentialsProvider>	ssoprovider;
+	return ssoprovider;
+}
+#endif
+
+//----------------------------------------------------------
+// STS endpoints and Credentials Provider
+//----------------------------------------------------------
+// [NOTE]
+// If the STS endpoints are specified, S3fsSTSCredentialsProvider
+// is used for web identity and assume role. This provider keeps the
+// statistics of endpoints and caches the credentials, so it is kept
+// until FreeS3fsCredential is called(same as the SSO provider).
+//
+static Aws::String& GetSTSEndpoints()
+{
+	static Aws::String	stsendpoints;
+	return stsendpoints;
+}
+
+#ifdef S3FSAWSCRED_PROVIDER_STS
+static std::shared_ptr<S3fsSTSCredentialsProvider>& GetSTSProvider()
+{
+	static std::shared_ptr<S3fsSTSCredentialsProvider>	stsprovider;
+	return stsprovider;
+}
+#endif
+
+//----------------------------------------------------------
+// Container Credentials Provider
+//----------------------------------------------------------
+// [NOTE]
+// If AWS_CONTAINER_CREDENTIALS_RELATIVE_URI or FULL_URI environment
+// is set, S3fsContainerCredentialsProvider is used for ECS task role
+// and EKS Pod Identity. This provider caches the token file and the
+// credentials, so it is kept until FreeS3fsCredential is called.
+//
+#ifdef S3FSAWSCRED_PROVIDER_CONTAINER
+static std::shared_ptr<S3fsContainerCredentialsProvider>& GetContainerProvider()
+{
+	static std::shared_ptr<S3fsContainerCredentialsProvider>	containerprovider;
+	return containerprovider;
+}
+#endif
+
+//----------------------------------------------------------
+// Deadline milliseconds for one UpdateS3fsCredential call
+//----------------------------------------------------------
+// [NOTE]
+// If this value is set, UpdateS3fsCredential waits for another update
+// and tries providers only within this time, and the remaining time is
+// passed to the timeouts and retry strategy of the provider clients
+// (as far as possible).
+// When the deadline has passed, the last valid credentials are
+// returned if they have not expired yet, otherwise an error.
+//
+static int64_t	deadlinems = 0;
+
+static bool SetDeadlineMs(int64_t ms)
+{
+	if(0 != deadlinems){
+		return false;
+	}
+	if(ms <= 0 || (10 * 60 * 1000) < ms){					// Maximum is 10 minutes
+		return false;
+	}
+	deadlinems = ms;
+
+	return true;
+}
+
+//
+// Returns the deadline of the update which starts now(0 means no deadline)
+//
+static int64_t GetUpdateDeadline()
+{
+	return (0 != deadlinems) ? (S3fsGetMonotonicMs() + deadlinems) : 0;
+}
+
+//----------------------------------------------------------
+// Minimum valid seconds of credentials
+//----------------------------------------------------------
+// [NOTE]
+// If this value is set, UpdateS3fsCredential tries to return credentials
+// which are valid for at least this time, so that a long transfer(ex.
+// multipart upload) started with them does not straddle the expiration.
+// The cached credentials are refreshed when their remaining time gets
+// shorter than this, and the next credentials are prefetched in the
+// background when it gets shorter than twice this time(up to half of
+// their lifetime). So the next credentials are obtained while the
+// current ones are still valid.
+// If the upstream issues shorter credentials, the valid credentials are
+// returned anyway. Only UpdateS3fsCredentialValidFor returns an error.
+//
+static int64_t	minvalidms = 0;
+
+static bool SetMinValidSec(int64_t sec)
+{
+	if(0 != minvalidms){
+		return false;
+	}
+	if(sec <= 0 || (60 * 60 * 12) < sec){					// Maximum is 12 hours(maximum session duration)
+		return false;
+	}
+	minvalidms = sec * 1000;
+
+	return true;
+}
+
+//----------------------------------------------------------
+// Refresh jitter seconds of credentials
+//----------------------------------------------------------
+// [NOTE]
+// If this value is set, a random time up to this value is added to
+// the refresh margin of the cached credentials(SSO, STS and container).
+// The mounts which got the same credentials(ex. on one host) refresh
+// them at different times, so the requests to the upstream are spread.
+//
+static int64_t	jitterms = 0;
+
+static bool SetRefreshJitterSec(int64_t sec)
+{
+	if(0 != jitterms){
+		return false;
+	}
+	if(sec <= 0 || (60 * 60) < sec){						// Maximum is 1 hour
+		return false;
+	}
+	jitterms = sec * 1000;
+
+	return true;
+}
+
+//
+// The last valid credentials(used when the deadline has passed)
+//
+// [NOTE]
+// These are protected by their own lock instead of the update lock,
+// because they are read by the callers which could not get the update
+// lock within the deadline.
+//
+static std::mutex& GetLastCredentialsLock()
+{
+	static std::mutex	lastcredlock;
+	return lastcredlock;
+}
+
+static Aws::Auth::AWSCredentials& GetLastCredentials()
+{
+	static Aws::Auth::AWSCredentials	lastcredentials;
+	return lastcredentials;
+}
+
+static void SetLastCredentials(const Aws::Auth::AWSCredentials& credentials)
+{
+	std::lock_guard<std::mutex>	guard(GetLastCredentialsLock());
+	GetLastCredentials() = credentials;
+}
+
+static bool GetLastValidCredentials(Aws::Auth::AWSCredentials& credentials, char** pperrstr)
+{
+	{
+		std::lock_guard<std::mutex>	guard(GetLastCredentialsLock());
+		const Aws::Auth::AWSCredentials&	lastcredentials = GetLastCredentials();
+		if(lastcredentials.IsEmpty() || S3fsIsExpiredWithin(lastcredentials, 0)){
+			if(pperrstr){
+				*pperrstr = strdup("Could not get credentials within the deadline(DeadlineMs), and there are no valid credentials.");
+			}
+			return false;
+		}
+		credentials = lastcredentials;
+	}
+	AWS_LOGSTREAM_WARN(S3fsAwsCredTag, "Could not get credentials within the deadline(DeadlineMs), so the last valid credentials are used.");
+	return true;
+}
+
 //----------------------------------------------------------
 // Auxiliary Valid period seconds
 //----------------------------------------------------------
@@ -188,58 +416,366 @@ static bool SetValidPeriodSec(int64_t sec)
 	return true;
 }
 
-static const Aws::Utils::DateTime& GetExparationByValidPeriod(const Aws::String& sessionToken, const Aws::Utils::DateTime& exp)
+static Aws::Utils::DateTime GetExparationByValidPeriod(const Aws::String& sessionToken, const Aws::Utils::DateTime& exp)
 {
-	static Aws::String			targetSessionToken;
-	static Aws::Utils::DateTime	targetExpiration;
+	static S3fsValidPeriod	validperiod;
 
 	if(-1 == periodsec){
 		return exp;
 	}
-	if(targetSessionToken != sessionToken){
-		// Update new session token
-		int64_t	expms		= exp.Millis();
-		int64_t	maxms		= Aws::Utils::DateTime::CurrentTimeMillis() + (periodsec * 1000);
-		targetExpiration	= Aws::Utils::DateTime(std::min(expms, maxms));
-		targetSessionToken	= sessionToken;
+	return validperiod.GetExpiration(periodsec, sessionToken, exp);
+}
+
+//----------------------------------------------------------
+// Snapshot of the current credentials
+//----------------------------------------------------------
+// [NOTE]
+// ProbeS3fsCredential reads the generation and the expiration of the
+// current credentials from this snapshot without locks and allocation.
+// The generation is incremented when UpdateS3fsCredential gets the
+// credentials different from the last ones. The expiration is kept on
+// the monotonic clock.
+// The snapshot is written only under the update lock(one writer), and
+// is read with the sequence counter(seqlock). The sequence is odd while
+// the snapshot is being written.
+//
+static std::atomic<uint64_t>	snapshotSequence(0);
+static std::atomic<uint64_t>	snapshotGeneration(0);
+static std::atomic<int64_t>		snapshotExpirationMono(0);
+
+static void SetCredentialSnapshot(uint64_t generation, int64_t expirationmono)
+{
+	uint64_t	sequence = snapshotSequence.load(std::memory_order_relaxed);
+
+	snapshotSequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	snapshotGeneration.store(generation, std::memory_order_relaxed);
+	snapshotExpirationMono.store(expirationmono, std::memory_order_relaxed);
+	snapshotSequence.store(sequence + 2, std::memory_order_release);
+}
+
+static void GetCredentialSnapshot(uint64_t& generation, int64_t& expirationmono)
+{
+	uint64_t	sequence;
+	do{
+		sequence		= snapshotSequence.load(std::memory_order_acquire);
+		generation		= snapshotGeneration.load(std::memory_order_relaxed);
+		expirationmono	= snapshotExpirationMono.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+	}while(0 != (sequence & 1) || sequence != snapshotSequence.load(std::memory_order_relaxed));
+}
+
+//
+// Publish the credentials returned by UpdateS3fsCredential
+//
+// [NOTE]
+// This is called under the update lock.
+//
+static void PublishCredentialSnapshot(const Aws::String& accessKeyId, const Aws::String& sessionToken, const Aws::Utils::DateTime& expiration)
+{
+	static Aws::String	lastAccessKeyId;
+	static Aws::String	lastSessionToken;
+
+	uint64_t	generation	= snapshotGeneration.load(std::memory_order_relaxed);
+	if(0 == generation || lastAccessKeyId != accessKeyId || lastSessionToken != sessionToken){
+		++generation;
+		lastAccessKeyId		= accessKeyId;
+		lastSessionToken	= sessionToken;
 	}
-	return targetExpiration;
+	int64_t	remainingms = expiration.Millis() - S3fsGetCurrentTimeMs();
+	SetCredentialSnapshot(generation, S3fsGetMonotonicMs() + remainingms);
 }
 
 //----------------------------------------------------------
-// Export interface functions
+// Lock for updating credentials
 //----------------------------------------------------------
+// [NOTE]
+// UpdateS3fsCredential may be called from the caller threads and the
+// asynchronous worker thread at the same time, so the update process
+// is serialized with this lock.
+// This lock is held while the providers access the network, so the
+// deadline(DeadlineMs) starts before waiting for it. Otherwise each
+// caller queued behind a slow update would wait for its own deadline
+// after the previous one.
 //
-// VersionS3fsCredential()
+static std::timed_mutex& GetUpdateLock()
+{
+	static std::timed_mutex	updatelock;
+	return updatelock;
+}
+
+static bool LockUpdateLock(std::unique_lock<std::timed_mutex>& guard, int64_t deadline)
+{
+	if(0 == deadline){
+		guard.lock();
+		return true;
+	}
+	return guard.try_lock_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(S3fsGetRemainingMs(deadline)));
+}
+
+//----------------------------------------------------------
+// Asynchronous update worker
+//----------------------------------------------------------
+// [NOTE]
+// The requests from UpdateS3fsCredentialAsync and the prefetch requests
+// are processed in order by one worker thread. The worker thread is
+// started by the first request, and is stopped by FreeS3fsCredential.
+// No request is accepted before InitS3fsCredential is called, because
+// the worker calls aws-sdk-cpp which needs Aws::InitAPI().
+// A prefetch request has no callback, it only refreshes the cached
+// credentials in providers with the refresh margin.
 //
-const char* VersionS3fsCredential(bool detail)
+typedef struct s3fs_async_request{
+	S3fsCredentialCallback	callback;				// NULL means prefetch
+	void*					puserdata;
+	int64_t					minvalidms;				// prefetch: refresh margin
+}S3FSASYNCREQ;
+
+typedef std::list<S3FSASYNCREQ>	s3fsasyncreq_list_t;
+
+typedef struct s3fs_async_worker{
+	std::mutex				lock;
+	std::condition_variable	cond;
+	std::thread				thread;
+	s3fsasyncreq_list_t		requests;
+	bool					running;
+	bool					stopping;				// set until InitS3fsCredential, and by FreeS3fsCredential
+	bool					prefetching;			// a prefetch request is queued
+	int64_t					currentexpirationms;	// expiration of the current credentials
+	int64_t					currentlifetimems;		// lifetime of the current credentials(from the first time they were seen)
+	int64_t					prefetchedexpirationms;	// expiration of the credentials for which a prefetch was posted
+
+	s3fs_async_worker() : running(false), stopping(true), prefetching(false), currentexpirationms(0), currentlifetimems(0), prefetchedexpirationms(0) {}
+}S3FSASYNCWORKER;
+
+static S3FSASYNCWORKER& GetAsyncWorker()
 {
-	const char short_version_form[]  = "s3fs-fuse-awscred-lib : Version %s (%s)";
-	const char detail_version_form[] = 
-		"s3fs-fuse-awscred-lib : Version %s (%s)\n"
-		"s3fs-fuse credential I/F library for AWS\n"
-		"Copyright 2022 Takeshi Nakatani <ggtakec@gmail.com>\n";
+	static S3FSASYNCWORKER	worker;
+	return worker;
+}
 
-	static char short_version_string[128];
-	static char detail_version_string[256];
-	static bool is_init = false;
+static bool S3fsAwsCredLoad(int64_t marginms, int64_t deadline, Aws::Auth::AWSCredentials& credentials, char** pperrstr);
+static bool S3fsAwsCredUpdate(char** ppaccess_key_id, char** ppserect_access_key, char** ppaccess_token, long long* ptoken_expire, char** pperrstr, int64_t minvalid, bool strict, int64_t deadline);
 
-	if(!is_init){
-		is_init = true;
-		sprintf(short_version_string, short_version_form, product_version, commit_hash_version);
-		sprintf(detail_version_string, detail_version_form, product_version, commit_hash_version);
+static void S3fsAwsCredAsyncWorkerProc()
+{
+	S3FSASYNCWORKER&	worker = GetAsyncWorker();
+
+	while(true){
+		S3FSASYNCREQ	request;
+		{
+			std::unique_lock<std::mutex>	guard(worker.lock);
+			worker.cond.wait(guard, [&worker]{ return (worker.stopping || !worker.requests.empty()); });
+			if(worker.stopping){
+				break;
+			}
+			request = worker.requests.front();
+			worker.requests.pop_front();
+			if(!request.callback){
+				worker.prefetching = false;
+			}
+		}
+
+		if(!request.callback){
+			Aws::Auth::AWSCredentials	credentials;
+			bool						result		= false;
+			int64_t						deadline	= GetUpdateDeadline();
+			{
+				std::unique_lock<std::timed_mutex>	guard(GetUpdateLock(), std::defer_lock);
+				if(LockUpdateLock(guard, deadline)){
+					result = S3fsAwsCredLoad(request.minvalidms, deadline, credentials, NULL);
+				}
+			}
+			S3FSAWSCRED_PROBE1(prefetch, result);
+			if(!result){
+				AWS_LOGSTREAM_ERROR(S3fsAwsCredTag, "Failed to prefetch credentials.");
+			}
+			continue;
+		}
+
+		char*		paccess_key_id		= NULL;
+		char*		pserect_access_key	= NULL;
+		char*		paccess_token		= NULL;
+		long long	token_expire		= 0;
+		char*		perrstr				= NULL;
+		bool		result				= S3fsAwsCredUpdate(&paccess_key_id, &pserect_access_key, &paccess_token, &token_expire, &perrstr, request.minvalidms, false, GetUpdateDeadline());
+
+		S3FSAWSCRED_PROBE1(update_async_callback, result);
+		if(result){
+			request.callback(true, paccess_key_id, pserect_access_key, paccess_token, token_expire, NULL, request.puserdata);
+		}else{
+			request.callback(false, NULL, NULL, NULL, 0, (perrstr ? perrstr : "Could not get credentials."), request.puserdata);
+		}
+		free(paccess_key_id);
+		free(pserect_access_key);
+		free(paccess_token);
+		free(perrstr);
 	}
-	if(detail){
-		return detail_version_string;
-	}else{
-		return short_version_string;
+}
+
+//
+// Push a request to the worker, and start the worker thread if needed
+//
+// [NOTE]
+// This is called under the worker lock.
+//
+static void S3fsAwsCredAsyncPush(S3FSASYNCWORKER& worker, S3fsCredentialCallback callback, void* puserdata, int64_t minvalid)
+{
+	if(!worker.running){
+		worker.thread	= std::thread(S3fsAwsCredAsyncWorkerProc);
+		worker.running	= true;
 	}
+	S3FSASYNCREQ	request;
+	request.callback	= callback;
+	request.puserdata	= puserdata;
+	request.minvalidms	= minvalid;
+	worker.requests.push_back(request);
+	worker.cond.notify_one();
 }
 
 //
-// InitS3fsCredential()
+// Post a request with the callback to the worker
 //
-bool InitS3fsCredential(const char* popts, char** pperrstr)
+static bool S3fsAwsCredAsyncPost(S3fsCredentialCallback callback, void* puserdata, int64_t minvalid)
+{
+	S3FSASYNCWORKER&				worker = GetAsyncWorker();
+	std::lock_guard<std::mutex>	guard(worker.lock);
+
+	if(worker.stopping){
+		return false;
+	}
+	S3fsAwsCredAsyncPush(worker, callback, puserdata, minvalid);
+
+	return true;
+}
+
+//
+// Post a prefetch request for the credentials which expire at expirationms
+//
+// [NOTE]
+// The prefetch margin is twice minvalid, but it is limited to half of
+// the lifetime of the credentials(from the first time they were seen).
+// If minvalid is half of the lifetime or more, the new credentials are
+// already within twice minvalid, and every call would prefetch again.
+// Only one prefetch is posted for each credential set(expiration), so
+// a prefetch which could not get new credentials is not repeated.
+//
+static bool S3fsAwsCredAsyncPrefetch(int64_t minvalid, int64_t expirationms)
+{
+	S3FSASYNCWORKER&				worker = GetAsyncWorker();
+	std::lock_guard<std::mutex>	guard(worker.lock);
+
+	if(worker.stopping){
+		return false;
+	}
+	int64_t	nowms = S3fsGetCurrentTimeMs();
+	if(worker.currentexpirationms != expirationms){
+		worker.currentexpirationms	= expirationms;
+		worker.currentlifetimems	= std::max<int64_t>(0, expirationms - nowms);
+	}
+	int64_t	margin = std::min(minvalid * 2, worker.currentlifetimems / 2);
+	if(margin <= (expirationms - nowms) || worker.prefetching || worker.prefetchedexpirationms == expirationms){
+		return true;
+	}
+	worker.prefetching				= true;
+	worker.prefetchedexpirationms	= expirationms;
+	S3fsAwsCredAsyncPush(worker, NULL, NULL, margin);
+
+	return true;
+}
+
+//
+// Returns true if this is called from the worker thread(callbacks)
+//
+static bool S3fsAwsCredAsyncIsWorkerThread()
+{
+	S3FSASYNCWORKER&			worker = GetAsyncWorker();
+	std::lock_guard<std::mutex>	guard(worker.lock);
+
+	return (worker.running && worker.thread.get_id() == std::this_thread::get_id());
+}
+
+//
+// Stop the worker thread, and cancel the pending requests
+//
+// [NOTE]
+// The request which is being processed is completed before the worker
+// thread exits. The pending requests are called back with an error in
+// this thread. After this function returns, no callback is called.
+// The stopping flag is kept until S3fsAwsCredAsyncRestart is called
+// (InitS3fsCredential), so the requests posted from the canceled
+// callbacks are rejected and no new worker thread is started while
+// the library is being uninitialized.
+//
+static void S3fsAwsCredAsyncStop()
+{
+	S3FSASYNCWORKER&	worker = GetAsyncWorker();
+	s3fsasyncreq_list_t	canceled;
+	{
+		std::lock_guard<std::mutex>	guard(worker.lock);
+		worker.stopping = true;
+		worker.cond.notify_all();
+	}
+	if(worker.thread.joinable()){
+		worker.thread.join();
+	}
+	{
+		std::lock_guard<std::mutex>	guard(worker.lock);
+		canceled.swap(worker.requests);
+		worker.running		= false;
+		worker.prefetching	= false;
+	}
+	for(s3fsasyncreq_list_t::const_iterator iter = canceled.begin(); iter != canceled.end(); ++iter){
+		if(iter->callback){
+			iter->callback(false, NULL, NULL, NULL, 0, "Canceled by FreeS3fsCredential.", iter->puserdata);
+		}
+	}
+}
+
+//
+// Accept requests again after S3fsAwsCredAsyncStop
+//
+static void S3fsAwsCredAsyncRestart()
+{
+	S3FSASYNCWORKER&			worker = GetAsyncWorker();
+	std::lock_guard<std::mutex>	guard(worker.lock);
+
+	worker.stopping					= false;
+	worker.currentexpirationms		= 0;
+	worker.currentlifetimems		= 0;
+	worker.prefetchedexpirationms	= 0;
+}
+
+//----------------------------------------------------------
+// Internal functions for interface
+//----------------------------------------------------------
+//
+// Convert the option value to an integer
+//
+// [NOTE]
+// std::stoll throws an exception for an invalid value, and it must not
+// go through InitS3fsCredential(extern "C"). So the value is checked
+// with strtoll, and the caller returns an error.
+//
+static bool S3fsAwsCredParseInteger(const std::string& strValue, int64_t& value)
+{
+	if(strValue.empty()){
+		return false;
+	}
+	char*		endptr	= NULL;
+	errno				= 0;
+	long long	result	= strtoll(strValue.c_str(), &endptr, 10);
+	if(0 != errno || endptr == strValue.c_str() || '\0' != *endptr){
+		return false;
+	}
+	value = static_cast<int64_t>(result);
+	return true;
+}
+
+//
+// S3fsAwsCredInit() : for InitS3fsCredential()
+//
+static bool S3fsAwsCredInit(const char* popts, char** pperrstr)
 {
 	if(pperrstr){
 		*pperrstr = NULL;
@@ -278,6 +814,24 @@ bool InitS3fsCredential(const char* popts, char** pperrstr)
 				}
 				ssoprofile = strValue.c_str();
 
+			}else if(0 == strcasecmp(strLowkey.c_str(), "SSOPortalEndpoint") || 0 == strcasecmp(strLowkey.c_str(), "SSOPortal")){
+				if(strValue.empty()){
+					if(pperrstr){
+						*pperrstr = strdup("Option(SSOPortalEndpoint) value is empty.");
+					}
+					return false;
+				}
+				GetSSOPortalEndpoint() = strValue.c_str();
+
+			}else if(0 == strcasecmp(strLowkey.c_str(), "SSOOIDCEndpoint") || 0 == strcasecmp(strLowkey.c_str(), "SSOOIDC")){
+				if(strValue.empty()){
+					if(pperrstr){
+						*pperrstr = strdup("Option(SSOOIDCEndpoint) value is empty.");
+					}
+					return false;
+				}
+				GetSSOOIDCEndpoint() = strValue.c_str();
+
 			}else if(0 == strcasecmp(strLowkey.c_str(), "TokenPeriodSecond") || 0 == strcasecmp(strLowkey.c_str(), "PeriodSec")){
 				if(strValue.empty()){
 					if(pperrstr){
@@ -285,7 +839,13 @@ bool InitS3fsCredential(const char* popts, char** pperrstr)
 					}
 					return false;
 				}
-				int64_t	periodsec = static_cast<int64_t>(stoll(strValue));
+				int64_t	periodsec = 0;
+				if(!S3fsAwsCredParseInteger(strValue, periodsec)){
+					if(pperrstr){
+						*pperrstr = strdup("Option(TokenPeriodSecond) value is not a number.");
+					}
+					return false;
+				}
 
 				if(!SetValidPeriodSec(periodsec)){
 					if(pperrstr){
@@ -294,6 +854,88 @@ bool InitS3fsCredential(const char* popts, char** pperrstr)
 					return false;
 				}
 
+			}else if(0 == strcasecmp(strLowkey.c_str(), "STSEndpoints")){
+				if(strValue.empty()){
+					if(pperrstr){
+						*pperrstr = strdup("Option(STSEndpoints) value is empty.");
+					}
+					return false;
+				}
+				Aws::String&	stsendpoints = GetSTSEndpoints();
+				if(!stsendpoints.empty()){
+					if(pperrstr){
+						*pperrstr = strdup("Already specified STS endpoints.");
+					}
+					return false;
+				}
+				stsendpoints = strValue.c_str();
+
+			}else if(0 == strcasecmp(strLowkey.c_str(), "MinValidSecond") || 0 == strcasecmp(strLowkey.c_str(), "MinValidSec")){
+				if(strValue.empty()){
+					if(pperrstr){
+						*pperrstr = strdup("Option(MinValidSecond) value is empty.");
+					}
+					return false;
+				}
+				int64_t	minvalidsec = 0;
+				if(!S3fsAwsCredParseInteger(strValue, minvalidsec)){
+					if(pperrstr){
+						*pperrstr = strdup("Option(MinValidSecond) value is not a number.");
+					}
+					return false;
+				}
+
+				if(!SetMinValidSec(minvalidsec)){
+					if(pperrstr){
+						*pperrstr = strdup("Failed to set Minimum Valid Seconds.");
+					}
+					return false;
+				}
+
+			}else if(0 == strcasecmp(strLowkey.c_str(), "RefreshJitterSecond") || 0 == strcasecmp(strLowkey.c_str(), "JitterSec")){
+				if(strValue.empty()){
+					if(pperrstr){
+						*pperrstr = strdup("Option(RefreshJitterSecond) value is empty.");
+					}
+					return false;
+				}
+				int64_t	jittersec = 0;
+				if(!S3fsAwsCredParseInteger(strValue, jittersec)){
+					if(pperrstr){
+						*pperrstr = strdup("Option(RefreshJitterSecond) value is not a number.");
+					}
+					return false;
+				}
+
+				if(!SetRefreshJitterSec(jittersec)){
+					if(pperrstr){
+						*pperrstr = strdup("Failed to set Refresh Jitter Seconds.");
+					}
+					return false;
+				}
+
+			}else if(0 == strcasecmp(strLowkey.c_str(), "DeadlineMs") || 0 == strcasecmp(strLowkey.c_str(), "Deadline")){
+				if(strValue.empty()){
+					if(pperrstr){
+						*pperrstr = strdup("Option(DeadlineMs) value is empty.");
+					}
+					return false;
+				}
+				int64_t	deadline = 0;
+				if(!S3fsAwsCredParseInteger(strValue, deadline)){
+					if(pperrstr){
+						*pperrstr = strdup("Option(DeadlineMs) value is not a number.");
+					}
+					return false;
+				}
+
+				if(!SetDeadlineMs(deadline)){
+					if(pperrstr){
+						*pperrstr = strdup("Failed to set Deadline Milliseconds.");
+					}
+					return false;
+				}
+
 			}else if(0 == strcasecmp(strLowkey.c_str(), "LogLevel")){
 				if(0 == strcasecmp(strValue.c_str(), "Off")){
 					if(isSetLogLevel){
@@ -438,35 +1080,212 @@ bool InitS3fsCredential(const char* popts, char** pperrstr)
 		}
 	}
 
+	//
+	// Check the minimum valid time with the session token period
+	//
+	// [NOTE]
+	// The credentials with TokenPeriodSecond are never valid for
+	// MinValidSecond or more, they would be refreshed at every call.
+	//
+	if(0 < minvalidms && -1 != periodsec && (periodsec * 1000) <= minvalidms){
+		if(pperrstr){
+			*pperrstr = strdup("Option(MinValidSecond) must be less than Option(TokenPeriodSecond).");
+		}
+		return false;
+	}
+
+	//
+	// Check options for the providers which are not built
+	//
+#ifndef S3FSAWSCRED_PROVIDER_SSO
+	if(!GetSSOProfile().empty() || !GetSSOPortalEndpoint().empty() || !GetSSOOIDCEndpoint().empty()){
+		if(pperrstr){
+			*pperrstr = strdup("SSO options are specified, but the SSO provider is not built in this library.");
+		}
+		return false;
+	}
+#endif
+#ifndef S3FSAWSCRED_PROVIDER_STS
+	if(!GetSTSEndpoints().empty()){
+		if(pperrstr){
+			*pperrstr = strdup("Option(STSEndpoints) is specified, but the STS provider is not built in this library.");
+		}
+		return false;
+	}
+#endif
+
 	//
 	// Initalize
 	//
 	Aws::InitAPI(options);
+	S3fsAwsCredAsyncRestart();
 
 	return true;
 }
 
 //
-// FreeS3fsCredential()
+// S3fsAwsCredFree() : for FreeS3fsCredential()
 //
-bool FreeS3fsCredential(char** pperrstr)
+static bool S3fsAwsCredFree(char** pperrstr)
 {
 	if(pperrstr){
 		*pperrstr = NULL;
 	}
 
+	// [NOTE]
+	// The worker thread can not join itself(std::system_error), so this
+	// must not be called from the callback of UpdateS3fsCredentialAsync.
+	//
+	if(S3fsAwsCredAsyncIsWorkerThread()){
+		if(pperrstr){
+			*pperrstr = strdup("FreeS3fsCredential can not be called from the callback of UpdateS3fsCredentialAsync.");
+		}
+		return false;
+	}
+
 	//
 	// Shotdown
 	//
+	S3fsAwsCredAsyncStop();
+#ifdef S3FSAWSCRED_PROVIDER_SSO
+	GetSSOProvider().reset();
+#endif
+#ifdef S3FSAWSCRED_PROVIDER_STS
+	GetSTSProvider().reset();
+#endif
+#ifdef S3FSAWSCRED_PROVIDER_CONTAINER
+	GetContainerProvider().reset();
+#endif
+	{
+		// The current credentials are treated as expired
+		std::lock_guard<std::timed_mutex>	guard(GetUpdateLock());
+		SetCredentialSnapshot(snapshotGeneration.load(std::memory_order_relaxed), 0);
+	}
 	Aws::ShutdownAPI(GetSDKOptions());
 
+	//
+	// Clear options, so that InitS3fsCredential can be called again
+	//
+	GetSDKOptions() = Aws::SDKOptions();
+	GetSSOProfile().clear();
+	GetSSOPortalEndpoint().clear();
+	GetSSOOIDCEndpoint().clear();
+	GetSTSEndpoints().clear();
+	SetLastCredentials(Aws::Auth::AWSCredentials());
+	deadlinems	= 0;
+	minvalidms	= 0;
+	jitterms	= 0;
+	periodsec	= -1;
+
 	return true;
 }
 
 //
-// UpdateS3fsCredential()
+// S3fsAwsCredLoad()
 //
-bool UpdateS3fsCredential(char** ppaccess_key_id, char** ppserect_access_key, char** ppaccess_token, long long* ptoken_expire, char** pperrstr)
+// Get credentials from the provider chain.
+// marginms is the refresh margin passed to the cached providers, the
+// cached credentials which expire within it are refreshed.
+// deadline is the time to give up(0 means no deadline).
+//
+// [NOTE]
+// This is called under the update lock.
+//
+static bool S3fsAwsCredLoad(int64_t marginms, int64_t deadline, Aws::Auth::AWSCredentials& credentials, char** pperrstr)
+{
+	// Get SSO Profile option
+	const Aws::String&		ssoprofile	= GetSSOProfile();
+	const char*				pSSOProf	= ssoprofile.empty() ? nullptr : ssoprofile.c_str();
+
+	// Cached providers for the chain(set only if built)
+	std::shared_ptr<S3fsCachedCredentialsProvider>	cachedproviders[3];
+	std::shared_ptr<S3fsCachedCredentialsProvider>&	ssoprovider			= cachedproviders[0];
+	std::shared_ptr<S3fsCachedCredentialsProvider>&	stsprovider			= cachedproviders[1];
+	std::shared_ptr<S3fsCachedCredentialsProvider>&	containerprovider	= cachedproviders[2];
+
+#ifdef S3FSAWSCRED_PROVIDER_SSO
+	// SSO Provider is created only once
+	if(pSSOProf && !GetSSOProvider()){
+		const Aws::String&	ssoportal	= GetSSOPortalEndpoint();
+		const Aws::String&	ssooidc		= GetSSOOIDCEndpoint();
+		GetSSOProvider() = Aws::MakeShared<S3fsSSOCredentialsProvider>("S3fsSSOCredentialsProvider", pSSOProf, (ssoportal.empty() ? nullptr : ssoportal.c_str()), (ssooidc.empty() ? nullptr : ssooidc.c_str()));
+	}
+	ssoprovider = GetSSOProvider();
+#endif
+
+#ifdef S3FSAWSCRED_PROVIDER_STS
+	// STS Provider is created only once
+	//
+	// [NOTE]
+	// If DeadlineMs is specified without STSEndpoints, the regional
+	// endpoint of the default region is used, so that the web identity
+	// and AssumeRole requests are limited by the deadline.
+	//
+	if(!GetSTSProvider()){
+		Aws::String	endpoints = GetSTSEndpoints();
+		if(endpoints.empty() && 0 != deadlinems){
+			endpoints = S3fsSTSEndpointSelector::GetDefaultRegion();
+		}
+		if(!endpoints.empty()){
+			auto	selector = Aws::MakeShared<S3fsSTSEndpointSelector>("S3fsSTSEndpointSelector", endpoints);
+			GetSTSProvider() = Aws::MakeShared<S3fsSTSCredentialsProvider>("S3fsSTSCredentialsProvider", selector);
+		}
+	}
+	stsprovider = GetSTSProvider();
+#endif
+
+#ifdef S3FSAWSCRED_PROVIDER_CONTAINER
+	// Container Provider is created only once
+	if(!GetContainerProvider()){
+		const auto	relativeUri = Aws::Environment::GetEnv("AWS_CONTAINER_CREDENTIALS_RELATIVE_URI");
+		const auto	absoluteUri = Aws::Environment::GetEnv("AWS_CONTAINER_CREDENTIALS_FULL_URI");
+		if(!relativeUri.empty() || !absoluteUri.empty()){
+			auto	provider = Aws::MakeShared<S3fsContainerCredentialsProvider>("S3fsContainerCredentialsProvider", relativeUri.c_str(), absoluteUri.c_str());
+			if(provider->IsConfigured()){
+				GetContainerProvider() = provider;
+			}
+		}
+	}
+	containerprovider = GetContainerProvider();
+#endif
+
+	// Deadline and refresh margin for this call
+	for(size_t cnt = 0; cnt < sizeof(cachedproviders) / sizeof(cachedproviders[0]); ++cnt){
+		if(cachedproviders[cnt]){
+			cachedproviders[cnt]->SetDeadline(deadline);
+			cachedproviders[cnt]->SetRefreshMargin(marginms);
+			cachedproviders[cnt]->SetRefreshJitter(jitterms);
+		}
+	}
+
+	// Create provider chain
+	S3fsAWSCredentialsProviderChain	providerChains(pSSOProf, ssoprovider, deadline, stsprovider, containerprovider);
+	credentials = providerChains.GetAWSCredentials();
+
+	if(!credentials.GetAWSAccessKeyId().empty() && !credentials.GetAWSSecretKey().empty()){
+		SetLastCredentials(credentials);
+
+	}else if(0 != deadline && (providerChains.IsDeadlineExceeded() || 0 == S3fsGetRemainingMs(deadline))){
+		return GetLastValidCredentials(credentials, pperrstr);
+	}
+	return true;
+}
+
+//
+// S3fsAwsCredUpdate() : for UpdateS3fsCredential()
+//
+// minvalid is the minimum valid milliseconds of credentials(0 means
+// no limit). The credentials are refreshed when they expire within it,
+// and the next ones are prefetched before that. If strict is true, an
+// error is returned when the credentials are not valid for minvalid
+// (UpdateS3fsCredentialValidFor). Otherwise the valid credentials are
+// returned anyway, so that the MinValidSecond option does not make an
+// outage when the upstream issues shorter credentials.
+// deadline is the time to give up(0 means no deadline). If the update
+// lock can not be taken within the deadline, the last valid credentials
+// are returned.
+//
+static bool S3fsAwsCredUpdate(char** ppaccess_key_id, char** ppserect_access_key, char** ppaccess_token, long long* ptoken_expire, char** pperrstr, int64_t minvalid, bool strict, int64_t deadline)
 {
 	if(!ppaccess_key_id || !ppserect_access_key || !ppaccess_token || !ptoken_expire){
 		if(pperrstr){
@@ -478,21 +1297,53 @@ bool UpdateS3fsCredential(char** ppaccess_key_id, char** ppserect_access_key, ch
 		*pperrstr = NULL;
 	}
 
-	// Get SSO Profile option
-	const Aws::String&		ssoprofile	= GetSSOProfile();
-	const char*				pSSOProf	= ssoprofile.empty() ? nullptr : ssoprofile.c_str();
+	Aws::SDKOptions&			options = GetSDKOptions();
+	Aws::Auth::AWSCredentials	credentials;
+	bool						result	= true;
+	Aws::String					accessKeyId;
+	Aws::String					secretKey;
+	Aws::String					sessionToken;
+	Aws::Utils::DateTime		expiration;
 
-	// Create provider chain
-	S3fsAWSCredentialsProviderChain	providerChains(pSSOProf);
-	Aws::SDKOptions&		options		= GetSDKOptions();
-	auto					credentials	= providerChains.GetAWSCredentials();
-	bool					result		= true;
+	{
+		std::unique_lock<std::timed_mutex>	guard(GetUpdateLock(), std::defer_lock);
+		if(!LockUpdateLock(guard, deadline)){
+			if(!GetLastValidCredentials(credentials, pperrstr)){
+				return false;
+			}
+		}else if(!S3fsAwsCredLoad(minvalid, deadline, credentials, pperrstr)){
+			return false;
+		}
 
-	// Get credentials
-	Aws::String				accessKeyId	= credentials.GetAWSAccessKeyId();
-	Aws::String				secretKey	= credentials.GetAWSSecretKey();
-	Aws::String				sessionToken= credentials.GetSessionToken();
-	Aws::Utils::DateTime	expiration	= GetExparationByValidPeriod(sessionToken, credentials.GetExpiration());
+		// Get credentials
+		accessKeyId		= credentials.GetAWSAccessKeyId();
+		secretKey		= credentials.GetAWSSecretKey();
+		sessionToken	= credentials.GetSessionToken();
+		expiration		= GetExparationByValidPeriod(sessionToken, credentials.GetExpiration());
+
+		// Check the remaining time of credentials
+		if(strict && 0 < minvalid && !accessKeyId.empty() && !secretKey.empty() && (expiration.Millis() - S3fsGetCurrentTimeMs()) < minvalid){
+			if(pperrstr){
+				*pperrstr = strdup("Could not get credentials which are valid for the specified time.");
+			}
+			result = false;
+		}else if(guard.owns_lock() && !accessKeyId.empty() && !secretKey.empty()){
+			// [NOTE]
+			// The snapshot is published only for the credentials returned
+			// to the caller, so that a failed update does not advance its
+			// generation.
+			//
+			PublishCredentialSnapshot(accessKeyId, sessionToken, expiration);
+		}
+	}
+
+	// Prefetch the next credentials
+	if(0 < minvalid && !accessKeyId.empty() && !secretKey.empty()){
+		S3fsAwsCredAsyncPrefetch(minvalid, expiration.Millis());
+	}
+	if(!result){
+		return false;
+	}
 
 	// Set result buffers
 	*ppaccess_key_id	= strdup(accessKeyId.c_str());
@@ -532,6 +1383,143 @@ bool UpdateS3fsCredential(char** ppaccess_key_id, char** ppserect_access_key, ch
 	return result;
 }
 
+//----------------------------------------------------------
+// Export interface functions
+//----------------------------------------------------------
+//
+// VersionS3fsCredential()
+//
+const char* VersionS3fsCredential(bool detail)
+{
+	const char short_version_form[]  = "s3fs-fuse-awscred-lib : Version %s (%s)";
+	const char detail_version_form[] = 
+		"s3fs-fuse-awscred-lib : Version %s (%s)\n"
+		"s3fs-fuse credential I/F library for AWS\n"
+		"Copyright 2022 Takeshi Nakatani <ggtakec@gmail.com>\n";
+
+	static char short_version_string[128];
+	static char detail_version_string[256];
+	static bool is_init = false;
+
+	S3FSAWSCRED_PROBE1(version_entry, detail);
+
+	if(!is_init){
+		is_init = true;
+		sprintf(short_version_string, short_version_form, product_version, commit_hash_version);
+		sprintf(detail_version_string, detail_version_form, product_version, commit_hash_version);
+	}
+	const char* pversion = detail ? detail_version_string : short_version_string;
+
+	S3FSAWSCRED_PROBE1(version_return, detail);
+	return pversion;
+}
+
+//
+// InitS3fsCredential()
+//
+bool InitS3fsCredential(const char* popts, char** pperrstr)
+{
+	S3FSAWSCRED_PROBE0(init_entry);
+	bool	result = S3fsAwsCredInit(popts, pperrstr);
+	S3FSAWSCRED_PROBE1(init_return, result);
+
+	return result;
+}
+
+//
+// FreeS3fsCredential()
+//
+bool FreeS3fsCredential(char** pperrstr)
+{
+	S3FSAWSCRED_PROBE0(free_entry);
+	bool	result = S3fsAwsCredFree(pperrstr);
+	S3FSAWSCRED_PROBE1(free_return, result);
+
+	return result;
+}
+
+//
+// UpdateS3fsCredential()
+//
+bool UpdateS3fsCredential(char** ppaccess_key_id, char** ppserect_access_key, char** ppaccess_token, long long* ptoken_expire, char** pperrstr)
+{
+	S3FSAWSCRED_PROBE0(update_entry);
+	bool	result = S3fsAwsCredUpdate(ppaccess_key_id, ppserect_access_key, ppaccess_token, ptoken_expire, pperrstr, minvalidms, false, GetUpdateDeadline());
+	S3FSAWSCRED_PROBE1(update_return, result);
+
+	return result;
+}
+
+//
+// UpdateS3fsCredentialValidFor()
+//
+bool UpdateS3fsCredentialValidFor(long long valid_sec, char** ppaccess_key_id, char** ppserect_access_key, char** ppaccess_token, long long* ptoken_expire, char** pperrstr)
+{
+	S3FSAWSCRED_PROBE1(update_validfor_entry, valid_sec);
+
+	bool	result;
+	if(valid_sec < 0 || (60 * 60 * 12) < valid_sec){
+		if(pperrstr){
+			*pperrstr = strdup("Valid seconds is out of range(0 - 43200).");
+		}
+		result = false;
+		S3FSAWSCRED_PROBE1(update_validfor_return, result);
+		return result;
+	}
+
+	result = S3fsAwsCredUpdate(ppaccess_key_id, ppserect_access_key, ppaccess_token, ptoken_expire, pperrstr, static_cast<int64_t>(valid_sec) * 1000, true, GetUpdateDeadline());
+	S3FSAWSCRED_PROBE1(update_validfor_return, result);
+
+	return result;
+}
+
+//
+// UpdateS3fsCredentialAsync()
+//
+bool UpdateS3fsCredentialAsync(S3fsCredentialCallback callback, void* puserdata, char** pperrstr)
+{
+	S3FSAWSCRED_PROBE0(update_async_entry);
+
+	bool	result;
+	if(pperrstr){
+		*pperrstr = NULL;
+	}
+	if(!callback){
+		if(pperrstr){
+			*pperrstr = strdup("Callback function is NULL.");
+		}
+		result = false;
+		S3FSAWSCRED_PROBE1(update_async_return, result);
+		return result;
+	}
+
+	result = S3fsAwsCredAsyncPost(callback, puserdata, minvalidms);
+	S3FSAWSCRED_PROBE1(update_async_return, result);
+
+	if(!result && pperrstr){
+		*pperrstr = strdup("Could not accept the request, because the library is not initialized.");
+	}
+	return result;
+}
+
+//
+// ProbeS3fsCredential()
+//
+bool ProbeS3fsCredential(unsigned long long* pgeneration, long long* pexpire_left)
+{
+	uint64_t	generation		= 0;
+	int64_t		expirationmono	= 0;
+	GetCredentialSnapshot(generation, expirationmono);
+
+	if(pgeneration){
+		*pgeneration = static_cast<unsigned long long>(generation);
+	}
+	if(pexpire_left){
+		*pexpire_left = (0 == generation) ? 0 : static_cast<long long>((expirationmono - S3fsGetMonotonicMs()) / 1000);
+	}
+	return (0 != generation);
+}
+
 /*
  * Local variables:
  * tab-width: 4
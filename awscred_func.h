@@ -113,6 +113,84 @@ extern bool FreeS3fsCredential(char** pperrstr) S3FS_FUNCATTR_WEAK;
 //
 extern bool UpdateS3fsCredential(char** ppaccess_key_id, char** ppserect_access_key, char** ppaccess_token, long long* ptoken_expire, char** pperrstr) S3FS_FUNCATTR_WEAK;
 
+//-------------------------------------------------------------------
+// Prototype for Extended functions(not used by s3fs-fuse)
+//-------------------------------------------------------------------
+//
+// [Optional] UpdateS3fsCredentialAsync
+//
+// A function that updates the token asynchronously.
+// This function returns immediately, and the callback function is
+// called from the worker thread in this library when the update is
+// finished.
+// If FreeS3fsCredential is called while the update is pending, the
+// callback function is called with result=false(canceled) before
+// FreeS3fsCredential returns. The callback function is never called
+// after FreeS3fsCredential returns, and new requests are rejected until
+// InitS3fsCredential is called again. The requests before the first
+// InitS3fsCredential are also rejected.
+// FreeS3fsCredential must not be called from the callback function(it
+// returns an error).
+//
+// S3fsCredentialCallback : Callback function, the arguments are the
+//                          same as UpdateS3fsCredential.
+//                          The string arguments are valid only while
+//                          the callback function is running, and they
+//                          must not be freed by the callback function.
+//                          If result is false, the credential strings
+//                          are NULL and perrstr is set.
+// void* puserdata        : Passed to the callback function as is.
+// char** pperrstr        : pperrstr is used to pass the error message to the
+//                          caller when the request could not be accepted.
+//
+// Returns true if the request is accepted.
+//
+typedef void (*S3fsCredentialCallback)(bool result, const char* paccess_key_id, const char* pserect_access_key, const char* paccess_token, long long token_expire, const char* perrstr, void* puserdata);
+
+extern bool UpdateS3fsCredentialAsync(S3fsCredentialCallback callback, void* puserdata, char** pperrstr) S3FS_FUNCATTR_WEAK;
+
+//
+// [Optional] UpdateS3fsCredentialValidFor
+//
+// A function that updates the token which is valid for at least the
+// specified time.
+// If the cached token expires within valid_sec, it is refreshed. If
+// the token expires within twice of valid_sec(up to half of its
+// lifetime), the next token is prefetched in the background once, so
+// the next call gets a new token while the current token is still
+// valid.
+//
+// long long valid_sec    : Minimum valid seconds of the token(0 - 43200).
+//                          If 0 is specified, it works the same as
+//                          UpdateS3fsCredential without MinValidSecond.
+// Other arguments        : Same as UpdateS3fsCredential.
+//
+// Returns false if the token which is valid for valid_sec could not be
+// obtained.
+//
+extern bool UpdateS3fsCredentialValidFor(long long valid_sec, char** ppaccess_key_id, char** ppserect_access_key, char** ppaccess_token, long long* ptoken_expire, char** pperrstr) S3FS_FUNCATTR_WEAK;
+
+//
+// [Optional] ProbeS3fsCredential
+//
+// A function that returns the generation and the remaining time of the
+// current credentials(the last ones returned by UpdateS3fsCredential).
+// This function does not allocate memory and does not take locks, and
+// it uses the monotonic clock, so it can be called for each request to
+// check whether the credentials need to be updated or have changed.
+//
+// unsigned long long* pgeneration : Set the generation of credentials.
+//                                   It is incremented when the credentials
+//                                   are changed, and 0 means no credentials
+//                                   have been obtained yet.
+// long long* pexpire_left         : Set the remaining seconds until the
+//                                   credentials expire. It is negative if
+//                                   they have expired.
+//
+// Returns false if no credentials have been obtained yet.
+//
+extern bool ProbeS3fsCredential(unsigned long long* pgeneration, long long* pexpire_left) S3FS_FUNCATTR_WEAK;
+
 }		// extern "C"
 
 #endif // AWSCRED_FUNC_H_
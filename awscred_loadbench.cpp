@@ -0,0 +1,222 @@
+/*
+ * s3fs-fuse-awscred-lib ( s3fs-fuse credential I/F library for AWS )
+ *
+ *     Copyright 2022 Takeshi Nakatani <ggtakec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//-------------------------------------------------------------------
+// [NOTE] About this program
+//-------------------------------------------------------------------
+// This program loads libs3fsawscred.so with dlopen in the same way as
+// s3fs-fuse, and measures the load cost of the library:
+//   - Time from dlopen to the first credential(dlopen, dlsym,
+//     InitS3fsCredential and UpdateS3fsCredential)
+//   - Mapped size and RSS increased by loading the library
+//   - Number of shared objects loaded
+//
+// Usage: s3fsawscred_loadbench [library path] [credlib_opts]
+//
+#include <dlfcn.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+
+#include "awscred_func.h"
+
+//-------------------------------------------------------------------
+// Function types
+//-------------------------------------------------------------------
+typedef decltype(&VersionS3fsCredential)	fn_version_t;
+typedef decltype(&InitS3fsCredential)		fn_init_t;
+typedef decltype(&FreeS3fsCredential)		fn_free_t;
+typedef decltype(&UpdateS3fsCredential)		fn_update_t;
+
+//-------------------------------------------------------------------
+// Utilities
+//-------------------------------------------------------------------
+static double GetElapsedMs(const struct timespec& start)
+{
+	struct timespec	now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<double>(now.tv_sec - start.tv_sec) * 1000.0 + static_cast<double>(now.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+//
+// Returns VmSize and VmRSS(kB) from /proc/self/status
+//
+static bool GetMemoryStatus(long& vmsize, long& vmrss)
+{
+	std::ifstream	status("/proc/self/status");
+	std::string		line;
+
+	vmsize = -1;
+	vmrss  = -1;
+	while(std::getline(status, line)){
+		if(0 == line.compare(0, 7, "VmSize:")){
+			vmsize = strtol(line.c_str() + 7, NULL, 10);
+		}else if(0 == line.compare(0, 6, "VmRSS:")){
+			vmrss = strtol(line.c_str() + 6, NULL, 10);
+		}
+	}
+	return (-1 != vmsize && -1 != vmrss);
+}
+
+//
+// Returns the total size(kB) of mappings of the file which includes pattern
+//
+static long GetMappedSize(const char* pattern)
+{
+	std::ifstream	maps("/proc/self/maps");
+	std::string		line;
+	long			total = 0;
+
+	while(std::getline(maps, line)){
+		if(std::string::npos == line.find(pattern)){
+			continue;
+		}
+		unsigned long	start = 0;
+		unsigned long	end   = 0;
+		if(2 == sscanf(line.c_str(), "%lx-%lx", &start, &end)){
+			total += static_cast<long>((end - start) / 1024);
+		}
+	}
+	return total;
+}
+
+static int CountSharedObject(struct dl_phdr_info* info, size_t size, void* data)
+{
+	(void)info;
+	(void)size;
+	++(*static_cast<int*>(data));
+	return 0;
+}
+
+static int GetSharedObjectCount()
+{
+	int	count = 0;
+	dl_iterate_phdr(CountSharedObject, &count);
+	return count;
+}
+
+//-------------------------------------------------------------------
+// Main
+//-------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	const char*	plibpath	= (1 < argc) ? argv[1] : "libs3fsawscred.so";
+	const char*	popts		= (2 < argc) ? argv[2] : "Off";
+	char*		perrstr		= NULL;
+
+	long		before_vmsize	= 0;
+	long		before_vmrss	= 0;
+	int			before_objcnt	= GetSharedObjectCount();
+	GetMemoryStatus(before_vmsize, before_vmrss);
+
+	//
+	// dlopen and dlsym
+	//
+	struct timespec	start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	void*	handle = dlopen(plibpath, RTLD_LAZY);
+	if(!handle){
+		std::cerr << "[ERROR] Could not load " << plibpath << " : " << dlerror() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	double	dlopen_ms = GetElapsedMs(start);
+
+	fn_version_t	pVersion	= reinterpret_cast<fn_version_t>(dlsym(handle, "VersionS3fsCredential"));
+	fn_init_t		pInit		= reinterpret_cast<fn_init_t>(dlsym(handle, "InitS3fsCredential"));
+	fn_free_t		pFree		= reinterpret_cast<fn_free_t>(dlsym(handle, "FreeS3fsCredential"));
+	fn_update_t		pUpdate		= reinterpret_cast<fn_update_t>(dlsym(handle, "UpdateS3fsCredential"));
+	if(!pVersion || !pUpdate){
+		std::cerr << "[ERROR] Could not find required functions in " << plibpath << std::endl;
+		dlclose(handle);
+		exit(EXIT_FAILURE);
+	}
+	double	dlsym_ms = GetElapsedMs(start);
+
+	//
+	// InitS3fsCredential
+	//
+	if(pInit && !pInit(popts, &perrstr)){
+		std::cerr << "[ERROR] Could not initialize " << plibpath << " : " << (perrstr ? perrstr : "unknown") << std::endl;
+		free(perrstr);
+		dlclose(handle);
+		exit(EXIT_FAILURE);
+	}
+	double	init_ms = GetElapsedMs(start);
+
+	//
+	// UpdateS3fsCredential(first credential)
+	//
+	char*		paccess_key_id		= NULL;
+	char*		pserect_access_key	= NULL;
+	char*		paccess_token		= NULL;
+	long long	token_expire		= 0;
+	bool		result				= pUpdate(&paccess_key_id, &pserect_access_key, &paccess_token, &token_expire, &perrstr);
+	double		first_ms			= GetElapsedMs(start);
+
+	if(!result){
+		std::cerr << "[WARNING] Could not get Credential : " << (perrstr ? perrstr : "unknown") << std::endl;
+	}
+	free(paccess_key_id);
+	free(pserect_access_key);
+	free(paccess_token);
+	free(perrstr);
+	perrstr = NULL;
+
+	//
+	// Memory
+	//
+	long	after_vmsize	= 0;
+	long	after_vmrss		= 0;
+	int		after_objcnt	= GetSharedObjectCount();
+	long	lib_mapped		= GetMappedSize(strrchr(plibpath, '/') ? strrchr(plibpath, '/') + 1 : plibpath);
+	GetMemoryStatus(after_vmsize, after_vmrss);
+
+	std::cout << "[s3fsawscred_loadbench] " << pVersion(false)												<< std::endl;
+	std::cout << "  Library                      = " << plibpath											<< std::endl;
+	std::cout << "  dlopen                       = " << dlopen_ms	<< " ms"								<< std::endl;
+	std::cout << "  dlopen + dlsym               = " << dlsym_ms	<< " ms"								<< std::endl;
+	std::cout << "  dlopen + InitS3fsCredential  = " << init_ms		<< " ms"								<< std::endl;
+	std::cout << "  dlopen to first credential   = " << first_ms	<< " ms" << (result ? "" : " (failed)")	<< std::endl;
+	std::cout << "  Mapped size of library       = " << lib_mapped	<< " kB"								<< std::endl;
+	std::cout << "  Increased mapped size(VmSize)= " << (after_vmsize - before_vmsize) << " kB"				<< std::endl;
+	std::cout << "  Increased RSS(VmRSS)         = " << (after_vmrss - before_vmrss) << " kB"				<< std::endl;
+	std::cout << "  Loaded shared objects        = " << (after_objcnt - before_objcnt)						<< std::endl;
+
+	if(pFree && !pFree(&perrstr)){
+		std::cerr << "[WARNING] Could not uninitialize " << plibpath << " : " << (perrstr ? perrstr : "unknown") << std::endl;
+		free(perrstr);
+	}
+	dlclose(handle);
+
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noexpandtab sw=4 ts=4 fdm=marker
+ * vim<600: noexpandtab sw=4 ts=4
+ */
@@ -0,0 +1,76 @@
+/*
+ * s3fs-fuse-awscred-lib ( s3fs-fuse credential I/F library for AWS )
+ *
+ *     Copyright 2022 Takeshi Nakatani <ggtakec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AWSCRED_PROBE_H_
+#define AWSCRED_PROBE_H_
+
+//-------------------------------------------------------------------
+// USDT(User Statically-Defined Tracing) probes
+//-------------------------------------------------------------------
+// [NOTE]
+// These probes are enabled only when this library is built with the
+// USE_USDT_PROBES option(cmake -DUSE_USDT_PROBES=ON), and use the
+// sys/sdt.h(systemtap-sdt-dev) macros.
+// A probe is only a nop instruction until a tracer(bpftrace, perf,
+// etc) attaches to it, so there is almost no cost at runtime.
+// If the option is not specified, these macros are empty.
+//
+// All probes belong to the "s3fsawscred" provider, for example:
+//   bpftrace -e 'usdt:./libs3fsawscred.so:s3fsawscred:update_entry { ... }'
+//
+// Probe list:
+//   version_entry / version_return(detail)
+//   init_entry / init_return(result)
+//   free_entry / free_return(result)
+//   update_entry / update_return(result)
+//   update_async_entry / update_async_return(result)
+//   update_async_callback(result)
+//   update_validfor_entry(valid_sec) / update_validfor_return(result)
+//   prefetch(result)
+//   provider_entry(index, name) / provider_return(index, name, result)
+//   cache_hit(name) / cache_miss(name) / cache_refresh(name, result)
+//   sts_endpoint(index, url, result)
+//
+#ifdef S3FSAWSCRED_USDT
+
+#include <sys/sdt.h>
+
+#define	S3FSAWSCRED_PROBE0(name)				DTRACE_PROBE(s3fsawscred, name)
+#define	S3FSAWSCRED_PROBE1(name, a1)			DTRACE_PROBE1(s3fsawscred, name, a1)
+#define	S3FSAWSCRED_PROBE2(name, a1, a2)		DTRACE_PROBE2(s3fsawscred, name, a1, a2)
+#define	S3FSAWSCRED_PROBE3(name, a1, a2, a3)	DTRACE_PROBE3(s3fsawscred, name, a1, a2, a3)
+
+#else	// S3FSAWSCRED_USDT
+
+#define	S3FSAWSCRED_PROBE0(name)
+#define	S3FSAWSCRED_PROBE1(name, a1)
+#define	S3FSAWSCRED_PROBE2(name, a1, a2)
+#define	S3FSAWSCRED_PROBE3(name, a1, a2, a3)
+
+#endif	// S3FSAWSCRED_USDT
+
+#endif // AWSCRED_PROBE_H_
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noexpandtab sw=4 ts=4 fdm=marker
+ * vim<600: noexpandtab sw=4 ts=4
+ */
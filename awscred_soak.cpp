@@ -0,0 +1,768 @@
+/*
+ * s3fs-fuse-awscred-lib ( s3fs-fuse credential I/F library for AWS )
+ *
+ *     Copyright 2022 Takeshi Nakatani <ggtakec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//-------------------------------------------------------------------
+// [NOTE] About this program
+//-------------------------------------------------------------------
+// This program is a soak and concurrency test for libs3fsawscred.so.
+// It repeats the cycle of InitS3fsCredential, UpdateS3fsCredential
+// from many threads and FreeS3fsCredential, against a local stand-in
+// endpoint which issues short-lived credentials and rotates its
+// authorization token quickly:
+//   container : Container credentials endpoint(AWS_CONTAINER_CREDENTIALS_FULL_URI
+//               and AWS_CONTAINER_AUTHORIZATION_TOKEN_FILE)
+//   sts       : STS endpoint for AssumeRoleWithWebIdentity(STSEndpoints
+//               option and AWS_WEB_IDENTITY_TOKEN_FILE)
+//
+// At each interval, it reports the RSS, the heap in use, the number of
+// allocations, the latency percentiles of UpdateS3fsCredential and the
+// number of upstream requests. At the end, it fails(exit code is not 0)
+// if any of the following is detected:
+//   - UpdateS3fsCredential failed or returned expired credentials
+//   - p99 or p999 latency of any interval exceeded the limit
+//   - RSS kept growing after the first cycle(warm up) beyond the limit
+//   - Heap in use after FreeS3fsCredential kept growing beyond the limit
+//
+// Usage: s3fsawscred_soak [options]
+//   --provider <container|sts>   Stand-in endpoint type(default: container)
+//   --threads <count>            Caller threads(default: 200)
+//   --duration <sec>             Duration of the whole test(default: 60)
+//   --cycles <count>             Init/Update/Free cycles(default: 3)
+//   --interval <sec>             Report interval(default: 5)
+//   --think <ms>                 Wait between calls in each thread(default: 10)
+//   --lifetime <sec>             Lifetime of credentials after the refresh
+//                                margin(default: 10)
+//   --rotate <sec>               Token rotation interval(default: 3)
+//   --max-p99 <ms>               Limit of p99 latency(default: 500)
+//   --max-p999 <ms>              Limit of p999 latency(default: 1000)
+//   --max-rss-growth <kB>        Limit of RSS growth(default: 16384)
+//   --max-heap-growth <kB>       Limit of heap growth between cycles(default: 1024)
+//
+// [NOTE]
+// This program does not use ~/.aws and the credential environments of
+// the caller, so it can be run on any host without AWS.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "awscred_func.h"
+#include "awscred_standin.h"
+
+//-------------------------------------------------------------------
+// Allocation counter
+//-------------------------------------------------------------------
+// [NOTE]
+// The global operator new/delete are replaced to count allocations in
+// this process(including the library and aws-sdk-cpp).
+// The heap in use(malloc) is taken from mallinfo.
+//
+static std::atomic<uint64_t>	allocCount(0);
+static std::atomic<uint64_t>	freeCount(0);
+
+void* operator new(size_t size)
+{
+	void*	ptr = malloc(size ? size : 1);
+	if(!ptr){
+		throw std::bad_alloc();
+	}
+	allocCount.fetch_add(1, std::memory_order_relaxed);
+	return ptr;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	void*	ptr = malloc(size ? size : 1);
+	if(ptr){
+		allocCount.fetch_add(1, std::memory_order_relaxed);
+	}
+	return ptr;
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	if(ptr){
+		freeCount.fetch_add(1, std::memory_order_relaxed);
+		free(ptr);
+	}
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	operator delete(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	operator delete(ptr);
+}
+
+//-------------------------------------------------------------------
+// Utilities
+//-------------------------------------------------------------------
+static int64_t GetNowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//
+// Returns VmRSS(kB) from /proc/self/status
+//
+static long GetRssKb()
+{
+	std::ifstream	status("/proc/self/status");
+	std::string		line;
+
+	while(std::getline(status, line)){
+		if(0 == line.compare(0, 6, "VmRSS:")){
+			return strtol(line.c_str() + 6, NULL, 10);
+		}
+	}
+	return -1;
+}
+
+//
+// Returns the heap in use(kB) by malloc
+//
+static long GetHeapKb()
+{
+#if defined(__GLIBC__) && (2 < __GLIBC__ || (2 == __GLIBC__ && 33 <= __GLIBC_MINOR__))
+	struct mallinfo2	info = mallinfo2();
+	return static_cast<long>(info.uordblks / 1024);
+#else
+	struct mallinfo		info = mallinfo();
+	return static_cast<long>(static_cast<unsigned int>(info.uordblks) / 1024);
+#endif
+}
+
+static bool WriteFileByRename(const std::string& path, const std::string& data)
+{
+	std::string	tmppath = path + ".tmp";
+	{
+		std::ofstream	out(tmppath.c_str(), std::ios::out | std::ios::trunc);
+		if(!out){
+			return false;
+		}
+		out << data << std::endl;
+	}
+	return (0 == rename(tmppath.c_str(), path.c_str()));
+}
+
+//-------------------------------------------------------------------
+// Latency histogram
+//-------------------------------------------------------------------
+// [NOTE]
+// Log-linear buckets of microseconds(8 buckets for each power of 2),
+// so the error of percentiles is within 12.5%. Each caller thread has
+// its own histogram, and the reporter reads them without locks.
+//
+#define	LATENCY_BUCKETS		320
+
+static size_t GetLatencyBucket(uint64_t us)
+{
+	if(us < 8){
+		return static_cast<size_t>(us);
+	}
+	int		msb		= 63 - __builtin_clzll(us);
+	size_t	bucket	= static_cast<size_t>((msb - 2) * 8) + static_cast<size_t>((us >> (msb - 3)) & 7);
+	return (bucket < LATENCY_BUCKETS ? bucket : (LATENCY_BUCKETS - 1));
+}
+
+static uint64_t GetLatencyBucketUpper(size_t bucket)
+{
+	if(bucket < 8){
+		return static_cast<uint64_t>(bucket);
+	}
+	int	msb = static_cast<int>(bucket / 8) + 2;
+	return ((static_cast<uint64_t>(8 + (bucket % 8)) << (msb - 3)) + (static_cast<uint64_t>(1) << (msb - 3)) - 1);
+}
+
+typedef struct soak_thread_stat{
+	std::atomic<uint64_t>	buckets[LATENCY_BUCKETS];
+	std::atomic<uint64_t>	calls;
+	std::atomic<uint64_t>	errors;
+	std::atomic<uint64_t>	stales;
+
+	soak_thread_stat() : calls(0), errors(0), stales(0)
+	{
+		for(size_t cnt = 0; cnt < LATENCY_BUCKETS; ++cnt){
+			buckets[cnt].store(0, std::memory_order_relaxed);
+		}
+	}
+}SOAKTHREADSTAT;
+
+typedef struct soak_totals{
+	uint64_t	buckets[LATENCY_BUCKETS];
+	uint64_t	calls;
+	uint64_t	errors;
+	uint64_t	stales;
+
+	soak_totals() : calls(0), errors(0), stales(0)
+	{
+		memset(buckets, 0, sizeof(buckets));
+	}
+}SOAKTOTALS;
+
+static void SumThreadStats(const std::vector<SOAKTHREADSTAT*>& stats, SOAKTOTALS& totals)
+{
+	totals = SOAKTOTALS();
+	for(std::vector<SOAKTHREADSTAT*>::const_iterator iter = stats.begin(); iter != stats.end(); ++iter){
+		for(size_t cnt = 0; cnt < LATENCY_BUCKETS; ++cnt){
+			totals.buckets[cnt] += (*iter)->buckets[cnt].load(std::memory_order_relaxed);
+		}
+		totals.calls	+= (*iter)->calls.load(std::memory_order_relaxed);
+		totals.errors	+= (*iter)->errors.load(std::memory_order_relaxed);
+		totals.stales	+= (*iter)->stales.load(std::memory_order_relaxed);
+	}
+}
+
+//
+// Returns the percentile(us) of the difference between two totals
+//
+static uint64_t GetPercentileUs(const SOAKTOTALS& current, const SOAKTOTALS& previous, double percentile)
+{
+	uint64_t	total = 0;
+	for(size_t cnt = 0; cnt < LATENCY_BUCKETS; ++cnt){
+		total += current.buckets[cnt] - previous.buckets[cnt];
+	}
+	if(0 == total){
+		return 0;
+	}
+	uint64_t	target	= static_cast<uint64_t>(static_cast<double>(total) * percentile);
+	uint64_t	sum		= 0;
+	for(size_t cnt = 0; cnt < LATENCY_BUCKETS; ++cnt){
+		sum += current.buckets[cnt] - previous.buckets[cnt];
+		if(target < sum){
+			return GetLatencyBucketUpper(cnt);
+		}
+	}
+	return GetLatencyBucketUpper(LATENCY_BUCKETS - 1);
+}
+
+//-------------------------------------------------------------------
+// Options
+//-------------------------------------------------------------------
+typedef struct soak_options{
+	bool	isSTS;
+	int		threads;
+	int		duration;
+	int		cycles;
+	int		interval;
+	int		thinkms;
+	int		lifetime;
+	int		rotate;
+	long	maxp99ms;
+	long	maxp999ms;
+	long	maxrssgrowth;
+	long	maxheapgrowth;
+
+	soak_options() : isSTS(false), threads(200), duration(60), cycles(3), interval(5), thinkms(10), lifetime(10), rotate(3), maxp99ms(500), maxp999ms(1000), maxrssgrowth(16384), maxheapgrowth(1024) {}
+}SOAKOPTIONS;
+
+static void PrintUsage(const char* prgname)
+{
+	std::cout << "Usage: " << prgname << " [options]"																<< std::endl;
+	std::cout << "  --provider <container|sts>   Stand-in endpoint type(default: container)"						<< std::endl;
+	std::cout << "  --threads <count>            Caller threads(default: 200)"										<< std::endl;
+	std::cout << "  --duration <sec>             Duration of the whole test(default: 60)"							<< std::endl;
+	std::cout << "  --cycles <count>             Init/Update/Free cycles(default: 3)"								<< std::endl;
+	std::cout << "  --interval <sec>             Report interval(default: 5)"										<< std::endl;
+	std::cout << "  --think <ms>                 Wait between calls in each thread(default: 10)"					<< std::endl;
+	std::cout << "  --lifetime <sec>             Lifetime of credentials after the refresh margin(default: 10)"	<< std::endl;
+	std::cout << "  --rotate <sec>               Token rotation interval(default: 3)"								<< std::endl;
+	std::cout << "  --max-p99 <ms>               Limit of p99 latency(default: 500)"								<< std::endl;
+	std::cout << "  --max-p999 <ms>              Limit of p999 latency(default: 1000)"								<< std::endl;
+	std::cout << "  --max-rss-growth <kB>        Limit of RSS growth(default: 16384)"								<< std::endl;
+	std::cout << "  --max-heap-growth <kB>       Limit of heap growth between cycles(default: 1024)"				<< std::endl;
+}
+
+static bool ParseOptions(int argc, char** argv, SOAKOPTIONS& opts)
+{
+	for(int cnt = 1; cnt < argc; ++cnt){
+		if(0 == strcmp(argv[cnt], "-h") || 0 == strcmp(argv[cnt], "--help")){
+			return false;
+		}
+		if((cnt + 1) >= argc){
+			std::cerr << "[ERROR] Option(" << argv[cnt] << ") needs a value." << std::endl;
+			return false;
+		}
+		const char*	value = argv[++cnt];
+
+		if(0 == strcmp(argv[cnt - 1], "--provider")){
+			if(0 == strcasecmp(value, "sts")){
+				opts.isSTS = true;
+			}else if(0 == strcasecmp(value, "container")){
+				opts.isSTS = false;
+			}else{
+				std::cerr << "[ERROR] Unknown provider(" << value << ") is specified." << std::endl;
+				return false;
+			}
+		}else if(0 == strcmp(argv[cnt - 1], "--threads")){
+			opts.threads = atoi(value);
+		}else if(0 == strcmp(argv[cnt - 1], "--duration")){
+			opts.duration = atoi(value);
+		}else if(0 == strcmp(argv[cnt - 1], "--cycles")){
+			opts.cycles = atoi(value);
+		}else if(0 == strcmp(argv[cnt - 1], "--interval")){
+			opts.interval = atoi(value);
+		}else if(0 == strcmp(argv[cnt - 1], "--think")){
+			opts.thinkms = atoi(value);
+		}else if(0 == strcmp(argv[cnt - 1], "--lifetime")){
+			opts.lifetime = atoi(value);
+		}else if(0 == strcmp(argv[cnt - 1], "--rotate")){
+			opts.rotate = atoi(value);
+		}else if(0 == strcmp(argv[cnt - 1], "--max-p99")){
+			opts.maxp99ms = atol(value);
+		}else if(0 == strcmp(argv[cnt - 1], "--max-p999")){
+			opts.maxp999ms = atol(value);
+		}else if(0 == strcmp(argv[cnt - 1], "--max-rss-growth")){
+			opts.maxrssgrowth = atol(value);
+		}else if(0 == strcmp(argv[cnt - 1], "--max-heap-growth")){
+			opts.maxheapgrowth = atol(value);
+		}else{
+			std::cerr << "[ERROR] Unknown option(" << argv[cnt - 1] << ") is specified." << std::endl;
+			return false;
+		}
+	}
+	if(opts.threads <= 0 || opts.duration <= 0 || opts.cycles <= 0 || opts.interval <= 0 || opts.thinkms < 0 || opts.lifetime <= 0 || opts.rotate <= 0){
+		std::cerr << "[ERROR] Option values must be positive." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+//-------------------------------------------------------------------
+// Local stand-in endpoint
+//-------------------------------------------------------------------
+// [NOTE]
+// This is the shared stand-in endpoint(awscred_standin.h) which accepts
+// the current and the previous authorization token(web identity token
+// for STS), and issues new credentials for each request which expire
+// after the refresh margin(5 minutes) and the lifetime. So the library
+// refreshes the credentials every lifetime seconds.
+// The token is rotated by the reporter thread with RotateToken.
+//
+static const int	S3FS_SOAK_REFRESH_MARGIN_SEC = 5 * 60;
+
+class SoakEndpoint
+{
+	private:
+		bool					isSTS;
+		int						lifetime;
+		std::string				tokenFile;
+		std::mutex				tokenLock;
+		std::string				currentToken;
+		std::string				previousToken;
+		uint64_t				tokenSerial;
+		std::atomic<uint64_t>	requests;
+		std::atomic<uint64_t>	rejects;
+		uint64_t				issueSerial;
+		S3fsStandinEndpoint		endpoint;
+
+	private:
+		void HandleRequest(const S3FSSTANDINREQ& req, S3FSSTANDINRES& res);
+		bool IsValidToken(const std::string& token);
+
+	public:
+		SoakEndpoint(bool sts, int lifetimesec, const std::string& tokenpath) : isSTS(sts), lifetime(lifetimesec), tokenFile(tokenpath), tokenSerial(0), requests(0), rejects(0), issueSerial(0), endpoint(std::bind(&SoakEndpoint::HandleRequest, this, std::placeholders::_1, std::placeholders::_2)) {}
+
+		bool Start();
+		void Stop() { endpoint.Stop(); }
+		bool RotateToken();
+
+		int GetPort() const { return endpoint.GetPort(); }
+		uint64_t GetRequests() const { return requests.load(std::memory_order_relaxed); }
+		uint64_t GetRejects() const { return rejects.load(std::memory_order_relaxed); }
+};
+
+bool SoakEndpoint::Start()
+{
+	if(!RotateToken()){
+		std::cerr << "[ERROR] Could not write token file " << tokenFile << std::endl;
+		return false;
+	}
+
+	return endpoint.Start();
+}
+
+//
+// Write a new token to the file(by rename, same as the kubelet), and
+// keep the previous token valid for the callers in flight.
+//
+bool SoakEndpoint::RotateToken()
+{
+	std::lock_guard<std::mutex>	guard(tokenLock);
+
+	std::ostringstream	ss;
+	ss << "soak-token-" << getpid() << "-" << (++tokenSerial);
+
+	if(!WriteFileByRename(tokenFile, ss.str())){
+		return false;
+	}
+	previousToken	= currentToken;
+	currentToken	= ss.str();
+
+	return true;
+}
+
+bool SoakEndpoint::IsValidToken(const std::string& token)
+{
+	std::lock_guard<std::mutex>	guard(tokenLock);
+	return (!token.empty() && (token == currentToken || token == previousToken));
+}
+
+void SoakEndpoint::HandleRequest(const S3FSSTANDINREQ& req, S3FSSTANDINRES& res)
+{
+	requests.fetch_add(1, std::memory_order_relaxed);
+
+	// Get token
+	std::string	token;
+	if(isSTS){
+		size_t	pos = req.body.find("WebIdentityToken=");
+		if(std::string::npos != pos){
+			token = req.body.substr(pos + 17);
+			token = token.substr(0, token.find('&'));
+		}
+	}else{
+		token = req.GetHeader("authorization");
+	}
+
+	// Make response
+	if(!IsValidToken(token)){
+		rejects.fetch_add(1, std::memory_order_relaxed);
+		res.status = (isSTS ? 400 : 401);
+		return;
+	}
+
+	std::ostringstream	accesskey;
+	std::ostringstream	secretkey;
+	std::ostringstream	sessiontoken;
+	++issueSerial;
+	accesskey		<< "ASIASOAK" << std::setw(12) << std::setfill('0') << issueSerial;
+	secretkey		<< "soak-secret-" << issueSerial;
+	sessiontoken	<< "soak-session-token-" << issueSerial;
+	std::string	expiration = S3fsStandinFormatIso8601(time(NULL) + S3FS_SOAK_REFRESH_MARGIN_SEC + lifetime);
+
+	std::ostringstream	body;
+	if(isSTS){
+		body << "<AssumeRoleWithWebIdentityResponse xmlns=\"https://sts.amazonaws.com/doc/2011-06-15/\"><AssumeRoleWithWebIdentityResult><Credentials>";
+		body << "<AccessKeyId>" << accesskey.str() << "</AccessKeyId>";
+		body << "<SecretAccessKey>" << secretkey.str() << "</SecretAccessKey>";
+		body << "<SessionToken>" << sessiontoken.str() << "</SessionToken>";
+		body << "<Expiration>" << expiration << "</Expiration>";
+		body << "</Credentials></AssumeRoleWithWebIdentityResult></AssumeRoleWithWebIdentityResponse>";
+		res.contentType = "text/xml";
+	}else{
+		body << "{\"AccessKeyId\":\"" << accesskey.str() << "\",\"SecretAccessKey\":\"" << secretkey.str() << "\",\"Token\":\"" << sessiontoken.str() << "\",\"Expiration\":\"" << expiration << "\"}";
+	}
+	res.status	= 200;
+	res.body	= body.str();
+}
+
+//-------------------------------------------------------------------
+// Caller thread
+//-------------------------------------------------------------------
+static void CallerProc(SOAKTHREADSTAT* pstat, const std::atomic<bool>* pstopping, int thinkms)
+{
+	while(!pstopping->load(std::memory_order_relaxed)){
+		char*		paccess_key_id		= NULL;
+		char*		pserect_access_key	= NULL;
+		char*		paccess_token		= NULL;
+		long long	token_expire		= 0;
+		char*		perrstr				= NULL;
+
+		int64_t		start	= GetNowUs();
+		bool		result	= UpdateS3fsCredential(&paccess_key_id, &pserect_access_key, &paccess_token, &token_expire, &perrstr);
+		int64_t		elapsed	= GetNowUs() - start;
+
+		pstat->buckets[GetLatencyBucket(static_cast<uint64_t>(0 < elapsed ? elapsed : 0))].fetch_add(1, std::memory_order_relaxed);
+		pstat->calls.fetch_add(1, std::memory_order_relaxed);
+		if(!result || !paccess_key_id || '\0' == paccess_key_id[0]){
+			pstat->errors.fetch_add(1, std::memory_order_relaxed);
+		}else if(token_expire <= static_cast<long long>(time(NULL))){
+			pstat->stales.fetch_add(1, std::memory_order_relaxed);
+		}
+		free(paccess_key_id);
+		free(pserect_access_key);
+		free(paccess_token);
+		free(perrstr);
+
+		if(0 < thinkms){
+			std::this_thread::sleep_for(std::chrono::milliseconds(thinkms));
+		}
+	}
+}
+
+//-------------------------------------------------------------------
+// Environments
+//-------------------------------------------------------------------
+// [NOTE]
+// Only the stand-in endpoint must be used, so the other credentials
+// (environments, ~/.aws, EC2 metadata) are disabled.
+//
+static void SetupEnvironments(const SOAKOPTIONS& opts, const std::string& tmpdir, const std::string& tokenfile, int port)
+{
+	S3fsStandinResetEnvironments(tmpdir);
+
+	std::ostringstream	url;
+	url << "http://127.0.0.1:" << port;
+	if(opts.isSTS){
+		setenv("AWS_ROLE_ARN",					"arn:aws:iam::123456789012:role/s3fsawscred-soak",	1);
+		setenv("AWS_WEB_IDENTITY_TOKEN_FILE",	tokenfile.c_str(),									1);
+		setenv("AWS_ROLE_SESSION_NAME",			"s3fsawscred-soak",									1);
+	}else{
+		url << "/v1/credentials";
+		setenv("AWS_CONTAINER_CREDENTIALS_FULL_URI",		url.str().c_str(),	1);
+		setenv("AWS_CONTAINER_AUTHORIZATION_TOKEN_FILE",	tokenfile.c_str(),	1);
+	}
+}
+
+//-------------------------------------------------------------------
+// Main
+//-------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+	SOAKOPTIONS	opts;
+	if(!ParseOptions(argc, argv, opts)){
+		PrintUsage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	// Temporary directory for the token file and the empty aws config
+	char	tmpdirbuff[] = "/tmp/s3fsawscred_soak.XXXXXX";
+	if(!mkdtemp(tmpdirbuff)){
+		std::cerr << "[ERROR] Could not create temporary directory : errno=" << errno << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::string	tmpdir		= tmpdirbuff;
+	std::string	tokenfile	= tmpdir + "/token";
+
+	SoakEndpoint	endpoint(opts.isSTS, opts.lifetime, tokenfile);
+	if(!endpoint.Start()){
+		rmdir(tmpdir.c_str());
+		exit(EXIT_FAILURE);
+	}
+	SetupEnvironments(opts, tmpdir, tokenfile, endpoint.GetPort());
+
+	std::string	credlibopts = "Off";
+	if(opts.isSTS){
+		std::ostringstream	ss;
+		ss << "Off,STSEndpoints=http://127.0.0.1:" << endpoint.GetPort();
+		credlibopts = ss.str();
+	}
+
+	std::cout << "[s3fsawscred_soak] " << VersionS3fsCredential(false)															<< std::endl;
+	std::cout << "  Provider = " << (opts.isSTS ? "sts" : "container") << ", Endpoint port = " << endpoint.GetPort()			<< std::endl;
+	std::cout << "  Threads = " << opts.threads << ", Duration = " << opts.duration << "s, Cycles = " << opts.cycles << ", Lifetime = " << opts.lifetime << "s, Rotate = " << opts.rotate << "s" << std::endl;
+	std::cout << std::endl;
+	std::cout << "  time(s) cycle      calls errors stales  p50(ms)  p99(ms) p999(ms)  rss(kB) heap(kB)   allocs/s upstream"	<< std::endl;
+
+	std::vector<SOAKTHREADSTAT*>	stats;
+	for(int cnt = 0; cnt < opts.threads; ++cnt){
+		stats.push_back(new SOAKTHREADSTAT);
+	}
+
+	SOAKTOTALS		previous;
+	SOAKTOTALS		current;
+	bool			failed				= false;
+	uint64_t		maxp99us			= 0;
+	uint64_t		maxp999us			= 0;
+	long			baseRss				= -1;
+	long			lastRss				= -1;
+	long			baseHeap			= -1;
+	long			lastHeap			= -1;
+	uint64_t		prevAllocs			= allocCount.load();
+	uint64_t		prevRequests		= 0;
+	int64_t			testStart			= GetNowUs();
+	int64_t			lastRotate			= testStart;
+	int64_t			cycleDurationUs		= static_cast<int64_t>(opts.duration) * 1000 * 1000 / opts.cycles;
+
+	for(int cycle = 1; cycle <= opts.cycles && !failed; ++cycle){
+		char*	perrstr = NULL;
+		if(!InitS3fsCredential(credlibopts.c_str(), &perrstr)){
+			std::cerr << "[ERROR] Could not initialize library : " << (perrstr ? perrstr : "unknown") << std::endl;
+			free(perrstr);
+			failed = true;
+			break;
+		}
+
+		std::atomic<bool>			stopping(false);
+		std::vector<std::thread>	threads;
+		for(int cnt = 0; cnt < opts.threads; ++cnt){
+			threads.push_back(std::thread(CallerProc, stats[cnt], &stopping, opts.thinkms));
+		}
+
+		int64_t	cycleStart	= GetNowUs();
+		int64_t	nextReport	= cycleStart + static_cast<int64_t>(opts.interval) * 1000 * 1000;
+		while(true){
+			int64_t	now = GetNowUs();
+			if((cycleStart + cycleDurationUs) <= now){
+				break;
+			}
+			if((lastRotate + static_cast<int64_t>(opts.rotate) * 1000 * 1000) <= now){
+				endpoint.RotateToken();
+				lastRotate = now;
+			}
+			if(nextReport <= now){
+				nextReport += static_cast<int64_t>(opts.interval) * 1000 * 1000;
+
+				SumThreadStats(stats, current);
+				uint64_t	p50		= GetPercentileUs(current, previous, 0.50);
+				uint64_t	p99		= GetPercentileUs(current, previous, 0.99);
+				uint64_t	p999	= GetPercentileUs(current, previous, 0.999);
+				uint64_t	allocs	= allocCount.load();
+				uint64_t	reqs	= endpoint.GetRequests();
+				long		rss		= GetRssKb();
+				long		heap	= GetHeapKb();
+
+				std::cout << "  " << std::setw(7) << ((now - testStart) / (1000 * 1000)) << " " << std::setw(5) << cycle;
+				std::cout << " " << std::setw(10) << (current.calls - previous.calls) << " " << std::setw(6) << (current.errors - previous.errors) << " " << std::setw(6) << (current.stales - previous.stales);
+				std::cout << std::fixed << std::setprecision(2) << " " << std::setw(8) << (static_cast<double>(p50) / 1000) << " " << std::setw(8) << (static_cast<double>(p99) / 1000) << " " << std::setw(8) << (static_cast<double>(p999) / 1000);
+				std::cout << " " << std::setw(8) << rss << " " << std::setw(8) << heap << " " << std::setw(10) << ((allocs - prevAllocs) / static_cast<uint64_t>(opts.interval)) << " " << std::setw(8) << (reqs - prevRequests) << std::endl;
+
+				maxp99us	= std::max(maxp99us, p99);
+				maxp999us	= std::max(maxp999us, p999);
+				lastRss		= rss;
+				if(-1 == baseRss && (1 < cycle || 1 == opts.cycles)){
+					// The first cycle is warm up
+					baseRss = rss;
+				}
+				previous		= current;
+				prevAllocs		= allocs;
+				prevRequests	= reqs;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+
+		stopping.store(true);
+		for(std::vector<std::thread>::iterator iter = threads.begin(); iter != threads.end(); ++iter){
+			iter->join();
+		}
+		if(!FreeS3fsCredential(&perrstr)){
+			std::cerr << "[ERROR] Could not uninitialize library : " << (perrstr ? perrstr : "unknown") << std::endl;
+			free(perrstr);
+			failed = true;
+		}
+
+		// Heap in use after FreeS3fsCredential(the first cycle is warm up)
+		lastHeap = GetHeapKb();
+		if(-1 == baseHeap){
+			baseHeap = lastHeap;
+		}
+		std::cout << "  cycle " << cycle << " finished : heap after FreeS3fsCredential = " << lastHeap << " kB, live allocations = " << (allocCount.load() - freeCount.load()) << std::endl;
+	}
+
+	endpoint.Stop();
+	unlink(tokenfile.c_str());
+	rmdir(tmpdir.c_str());
+
+	//
+	// Result
+	//
+	SumThreadStats(stats, current);
+	for(std::vector<SOAKTHREADSTAT*>::iterator iter = stats.begin(); iter != stats.end(); ++iter){
+		delete *iter;
+	}
+
+	std::cout << std::endl;
+	std::cout << "  Total calls       = " << current.calls														<< std::endl;
+	std::cout << "  Errors            = " << current.errors														<< std::endl;
+	std::cout << "  Stale credentials = " << current.stales														<< std::endl;
+	std::cout << "  Upstream requests = " << endpoint.GetRequests() << " (rejected " << endpoint.GetRejects() << ")"	<< std::endl;
+	std::cout << "  Max p99 / p999    = " << (static_cast<double>(maxp99us) / 1000) << " / " << (static_cast<double>(maxp999us) / 1000) << " ms" << std::endl;
+	std::cout << "  RSS growth        = " << ((-1 == baseRss || -1 == lastRss) ? 0 : (lastRss - baseRss)) << " kB"	<< std::endl;
+	std::cout << "  Heap growth       = " << (lastHeap - baseHeap) << " kB"										<< std::endl;
+	std::cout << std::endl;
+
+	if(0 == current.calls){
+		std::cerr << "[FAILED] UpdateS3fsCredential was never called." << std::endl;
+		failed = true;
+	}
+	if(0 != current.errors){
+		std::cerr << "[FAILED] UpdateS3fsCredential failed " << current.errors << " times." << std::endl;
+		failed = true;
+	}
+	if(0 != current.stales){
+		std::cerr << "[FAILED] UpdateS3fsCredential returned expired credentials " << current.stales << " times." << std::endl;
+		failed = true;
+	}
+	if(static_cast<uint64_t>(opts.maxp99ms) * 1000 < maxp99us){
+		std::cerr << "[FAILED] p99 latency exceeded the limit(" << opts.maxp99ms << " ms)." << std::endl;
+		failed = true;
+	}
+	if(static_cast<uint64_t>(opts.maxp999ms) * 1000 < maxp999us){
+		std::cerr << "[FAILED] p999 latency exceeded the limit(" << opts.maxp999ms << " ms)." << std::endl;
+		failed = true;
+	}
+	if(-1 != baseRss && -1 != lastRss && opts.maxrssgrowth < (lastRss - baseRss)){
+		std::cerr << "[FAILED] RSS grew more than the limit(" << opts.maxrssgrowth << " kB)." << std::endl;
+		failed = true;
+	}
+	if(opts.maxheapgrowth < (lastHeap - baseHeap)){
+		std::cerr << "[FAILED] Heap in use after FreeS3fsCredential grew more than the limit(" << opts.maxheapgrowth << " kB)." << std::endl;
+		failed = true;
+	}
+
+	if(failed){
+		std::cout << "[s3fsawscred_soak] FAILED" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::cout << "[s3fsawscred_soak] PASSED" << std::endl;
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noexpandtab sw=4 ts=4 fdm=marker
+ * vim<600: noexpandtab sw=4 ts=4
+ */
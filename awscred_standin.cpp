@@ -0,0 +1,231 @@
+/*
+ * s3fs-fuse-awscred-lib ( s3fs-fuse credential I/F library for AWS )
+ *
+ *     Copyright 2022 Takeshi Nakatani <ggtakec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <iostream>
+#include <sstream>
+
+#include "awscred_standin.h"
+
+//-------------------------------------------------------------------
+// Utilities
+//-------------------------------------------------------------------
+std::string S3fsStandinToLower(const std::string& str)
+{
+	std::string	lower = str;
+	for(std::string::iterator iter = lower.begin(); iter != lower.end(); ++iter){
+		*iter = static_cast<char>(tolower(*iter));
+	}
+	return lower;
+}
+
+std::string S3fsStandinFormatIso8601(time_t unixtime)
+{
+	struct tm	tm;
+	char		buff[32];
+	gmtime_r(&unixtime, &tm);
+	strftime(buff, sizeof(buff), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	return std::string(buff);
+}
+
+void S3fsStandinResetEnvironments(const std::string& configdir)
+{
+	const char*	unsetenvs[] = {
+		"AWS_ACCESS_KEY_ID", "AWS_SECRET_ACCESS_KEY", "AWS_SESSION_TOKEN", "AWS_PROFILE", "AWS_DEFAULT_PROFILE",
+		"AWS_ROLE_ARN", "AWS_WEB_IDENTITY_TOKEN_FILE", "AWS_ROLE_SESSION_NAME",
+		"AWS_CONTAINER_CREDENTIALS_RELATIVE_URI", "AWS_CONTAINER_CREDENTIALS_FULL_URI", "AWS_CONTAINER_AUTHORIZATION_TOKEN", "AWS_CONTAINER_AUTHORIZATION_TOKEN_FILE"
+	};
+	for(size_t cnt = 0; cnt < sizeof(unsetenvs) / sizeof(unsetenvs[0]); ++cnt){
+		unsetenv(unsetenvs[cnt]);
+	}
+	setenv("AWS_SHARED_CREDENTIALS_FILE",	(configdir + "/credentials").c_str(),	1);
+	setenv("AWS_CONFIG_FILE",				(configdir + "/config").c_str(),		1);
+	setenv("AWS_EC2_METADATA_DISABLED",		"true",									1);
+}
+
+static const char* GetReasonPhrase(int status)
+{
+	switch(status){
+		case 200:	return "OK";
+		case 400:	return "Bad Request";
+		case 401:	return "Unauthorized";
+		case 403:	return "Forbidden";
+		case 404:	return "Not Found";
+		case 500:	return "Internal Server Error";
+		default:	return "Error";
+	}
+}
+
+//-------------------------------------------------------------------
+// Methods : s3fs_standin_request
+//-------------------------------------------------------------------
+std::string s3fs_standin_request::GetHeader(const std::string& name) const
+{
+	size_t	pos = S3fsStandinToLower(headers).find("\r\n" + name + ":");
+	if(std::string::npos == pos){
+		return std::string("");
+	}
+	std::string	value = headers.substr(pos + name.size() + 3, headers.find("\r\n", pos + 2) - (pos + name.size() + 3));
+	value.erase(0, value.find_first_not_of(' '));
+	value.erase(value.find_last_not_of(" \r\n") + 1);
+	return value;
+}
+
+//-------------------------------------------------------------------
+// Methods : S3fsStandinEndpoint
+//-------------------------------------------------------------------
+bool S3fsStandinEndpoint::Start()
+{
+	struct sockaddr_in	addr;
+	socklen_t			addrlen = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family			= AF_INET;
+	addr.sin_addr.s_addr	= htonl(INADDR_LOOPBACK);
+	addr.sin_port			= 0;
+
+	if(-1 == (listenfd = socket(AF_INET, SOCK_STREAM, 0))){
+		std::cerr << "[ERROR] Could not create socket : errno=" << errno << std::endl;
+		return false;
+	}
+	int	on = 1;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if(0 != bind(listenfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) || 0 != listen(listenfd, 128) || 0 != getsockname(listenfd, reinterpret_cast<struct sockaddr*>(&addr), &addrlen)){
+		std::cerr << "[ERROR] Could not listen on loopback address : errno=" << errno << std::endl;
+		close(listenfd);
+		listenfd = -1;
+		return false;
+	}
+	port	= ntohs(addr.sin_port);
+	thread	= std::thread(&S3fsStandinEndpoint::ServerProc, this);
+
+	return true;
+}
+
+void S3fsStandinEndpoint::Stop()
+{
+	stopping.store(true);
+	if(thread.joinable()){
+		thread.join();
+	}
+	if(-1 != listenfd){
+		close(listenfd);
+		listenfd = -1;
+	}
+}
+
+void S3fsStandinEndpoint::ServerProc()
+{
+	while(!stopping.load()){
+		struct pollfd	pfd;
+		pfd.fd		= listenfd;
+		pfd.events	= POLLIN;
+		pfd.revents	= 0;
+		if(poll(&pfd, 1, 100) <= 0){
+			continue;
+		}
+		int	fd = accept(listenfd, NULL, NULL);
+		if(-1 == fd){
+			continue;
+		}
+		HandleConnection(fd);
+		close(fd);
+	}
+}
+
+void S3fsStandinEndpoint::HandleConnection(int fd)
+{
+	// Read request header and body
+	std::string	request;
+	size_t		headerEnd	= std::string::npos;
+	size_t		bodyLength	= 0;
+	char		buff[4096];
+	while(true){
+		if(std::string::npos != headerEnd && (headerEnd + 4 + bodyLength) <= request.size()){
+			break;
+		}
+		struct pollfd	pfd;
+		pfd.fd		= fd;
+		pfd.events	= POLLIN;
+		pfd.revents	= 0;
+		if(poll(&pfd, 1, 3000) <= 0){
+			return;
+		}
+		ssize_t	readbytes = read(fd, buff, sizeof(buff));
+		if(readbytes <= 0){
+			return;
+		}
+		request.append(buff, static_cast<size_t>(readbytes));
+
+		if(std::string::npos == headerEnd && std::string::npos != (headerEnd = request.find("\r\n\r\n"))){
+			std::string	lower	= S3fsStandinToLower(request.substr(0, headerEnd));
+			size_t		pos		= lower.find("\r\ncontent-length:");
+			if(std::string::npos != pos){
+				bodyLength = strtoul(lower.c_str() + pos + 17, NULL, 10);
+			}
+		}
+		if(64 * 1024 < request.size()){
+			return;
+		}
+	}
+
+	// Parse request line
+	S3FSSTANDINREQ	req;
+	std::string		requestLine	= request.substr(0, request.find("\r\n"));
+	size_t			sp1			= requestLine.find(' ');
+	size_t			sp2			= requestLine.find(' ', sp1 + 1);
+	std::string		target		= requestLine.substr(sp1 + 1, sp2 - (sp1 + 1));
+	req.method	= requestLine.substr(0, sp1);
+	req.path	= target.substr(0, target.find('?'));
+	req.query	= (std::string::npos == target.find('?')) ? std::string("") : target.substr(target.find('?') + 1);
+	req.headers	= request.substr(0, headerEnd) + "\r\n";
+	req.body	= request.substr(headerEnd + 4);
+
+	// Make response
+	S3FSSTANDINRES	res;
+	handler(req, res);
+
+	std::ostringstream	response;
+	response << "HTTP/1.1 " << res.status << " " << GetReasonPhrase(res.status) << "\r\nContent-Type: " << res.contentType << "\r\nContent-Length: " << res.body.size() << "\r\nConnection: close\r\n\r\n" << res.body;
+
+	std::string	strResponse = response.str();
+	size_t		written		= 0;
+	while(written < strResponse.size()){
+		ssize_t	result = write(fd, strResponse.c_str() + written, strResponse.size() - written);
+		if(result <= 0){
+			break;
+		}
+		written += static_cast<size_t>(result);
+	}
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noexpandtab sw=4 ts=4 fdm=marker
+ * vim<600: noexpandtab sw=4 ts=4
+ */
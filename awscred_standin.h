@@ -0,0 +1,113 @@
+/*
+ * s3fs-fuse-awscred-lib ( s3fs-fuse credential I/F library for AWS )
+ *
+ *     Copyright 2022 Takeshi Nakatani <ggtakec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AWSCRED_STANDIN_H_
+#define AWSCRED_STANDIN_H_
+
+//-------------------------------------------------------------------
+// [NOTE] About this file
+//-------------------------------------------------------------------
+// Local stand-in endpoint and utilities shared by the test programs
+// (stand-in test, soak test and fleet simulator). This is not built
+// into the library.
+//
+#include <time.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+//-------------------------------------------------------------------
+// Utilities
+//-------------------------------------------------------------------
+std::string S3fsStandinToLower(const std::string& str);
+std::string S3fsStandinFormatIso8601(time_t unixtime);
+
+//
+// Disable the credentials of the caller(environments, ~/.aws and EC2
+// metadata), so that only the stand-in endpoints are used.
+// The shared credentials and config files are set to "credentials"
+// and "config" in configdir.
+//
+void S3fsStandinResetEnvironments(const std::string& configdir);
+
+//-------------------------------------------------------------------
+// Request and response
+//-------------------------------------------------------------------
+typedef struct s3fs_standin_request{
+	std::string	method;
+	std::string	path;					// without query
+	std::string	query;
+	std::string	headers;				// as received
+	std::string	body;
+
+	std::string GetHeader(const std::string& name) const;	// name is lower case
+}S3FSSTANDINREQ;
+
+typedef struct s3fs_standin_response{
+	int			status;
+	std::string	contentType;
+	std::string	body;
+
+	s3fs_standin_response() : status(404), contentType("application/json") {}
+}S3FSSTANDINRES;
+
+typedef std::function<void(const S3FSSTANDINREQ&, S3FSSTANDINRES&)>	s3fs_standin_handler_t;
+
+//-------------------------------------------------------------------
+// Class S3fsStandinEndpoint
+//-------------------------------------------------------------------
+// [NOTE]
+// This is a minimal HTTP/1.1 server on the loopback address. Each
+// connection has one request, and the response is made by the handler
+// on the server thread(the requests are processed one by one).
+//
+class S3fsStandinEndpoint
+{
+	private:
+		s3fs_standin_handler_t	handler;
+		int						listenfd;
+		int						port;
+		std::thread				thread;
+		std::atomic<bool>		stopping;
+
+	private:
+		void ServerProc();
+		void HandleConnection(int fd);
+
+	public:
+		explicit S3fsStandinEndpoint(const s3fs_standin_handler_t& requesthandler) : handler(requesthandler), listenfd(-1), port(0), stopping(false) {}
+		~S3fsStandinEndpoint() { Stop(); }
+
+		bool Start();
+		void Stop();
+
+		int GetPort() const { return port; }
+		std::string GetUrl() const { return "http://127.0.0.1:" + std::to_string(port); }
+};
+
+#endif // AWSCRED_STANDIN_H_
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noexpandtab sw=4 ts=4 fdm=marker
+ * vim<600: noexpandtab sw=4 ts=4
+ */
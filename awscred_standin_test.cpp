@@ -0,0 +1,784 @@
+/*
+ * s3fs-fuse-awscred-lib ( s3fs-fuse credential I/F library for AWS )
+ *
+ *     Copyright 2022 Takeshi Nakatani <ggtakec@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//-------------------------------------------------------------------
+// [NOTE] About this program
+//-------------------------------------------------------------------
+// This program tests libs3fsawscred.so against local stand-in
+// endpoints on the loopback address:
+//   Options : InitS3fsCredential fails(without exceptions) with the
+//         invalid numeric option values.
+//   SSO : SSO OIDC(CreateToken with the refresh token) and SSO portal
+//         (GetRoleCredentials) with a token cache file in a temporary
+//         home directory.
+//   STS : a failing STS endpoint and a slow one(STSEndpoints option),
+//         the endpoint whose last request failed is tried after the
+//         others.
+//   Deadline : container credentials stand-in which is delayed longer
+//         than DeadlineMs, the last valid credentials are returned
+//         within the deadline.
+//   Async : FreeS3fsCredential from a callback is an error, and the
+//         requests retried from the canceled callbacks are rejected.
+//
+// The output does not have values which change for each run, so it is
+// compared with .github/workflows/s3fsawscred_standin_test.result.
+//
+// [NOTE]
+// This program does not use ~/.aws and the credential environments of
+// the caller, so it can be run on any host without AWS.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "awscred_func.h"
+#include "awscred_standin.h"
+
+//-------------------------------------------------------------------
+// Utilities
+//-------------------------------------------------------------------
+static bool WriteFile(const std::string& path, const std::string& data, mode_t mode)
+{
+	int	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if(-1 == fd){
+		return false;
+	}
+	bool	result = (static_cast<ssize_t>(data.size()) == write(fd, data.c_str(), data.size()));
+	return (0 == close(fd) && result);
+}
+
+static std::string ReadFile(const std::string& path)
+{
+	std::ifstream		in(path.c_str());
+	std::ostringstream	ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+//
+// Returns the string value of the key in JSON text(enough for this test)
+//
+static std::string GetJsonString(const std::string& json, const std::string& key)
+{
+	size_t	pos = json.find("\"" + key + "\"");
+	if(std::string::npos == pos || std::string::npos == (pos = json.find(':', pos)) || std::string::npos == (pos = json.find('"', pos))){
+		return std::string("");
+	}
+	size_t	endpos = json.find('"', pos + 1);
+	return (std::string::npos == endpos ? std::string("") : json.substr(pos + 1, endpos - (pos + 1)));
+}
+
+static void RemoveDirectory(const std::string& path)
+{
+	DIR*	dir = opendir(path.c_str());
+	if(dir){
+		struct dirent*	ent;
+		while(NULL != (ent = readdir(dir))){
+			if(0 == strcmp(ent->d_name, ".") || 0 == strcmp(ent->d_name, "..")){
+				continue;
+			}
+			std::string	child = path + "/" + ent->d_name;
+			struct stat	st;
+			if(0 == lstat(child.c_str(), &st) && S_ISDIR(st.st_mode)){
+				RemoveDirectory(child);
+			}else{
+				unlink(child.c_str());
+			}
+		}
+		closedir(dir);
+	}
+	rmdir(path.c_str());
+}
+
+static size_t CountFiles(const std::string& path)
+{
+	size_t	count	= 0;
+	DIR*	dir		= opendir(path.c_str());
+	if(dir){
+		struct dirent*	ent;
+		while(NULL != (ent = readdir(dir))){
+			if(0 != strcmp(ent->d_name, ".") && 0 != strcmp(ent->d_name, "..")){
+				++count;
+			}
+		}
+		closedir(dir);
+	}
+	return count;
+}
+
+//-------------------------------------------------------------------
+// Local stand-in endpoint
+//-------------------------------------------------------------------
+// [NOTE]
+// This wraps the shared stand-in endpoint(awscred_standin.h) with the
+// name and the delay of the response for each test. All requests to
+// the stand-ins are recorded in order before the delay, so that the
+// test can check which endpoints were called.
+//
+typedef std::function<void(const S3FSSTANDINREQ&, const std::string&, S3FSSTANDINRES&)>	standin_handler_t;
+
+static std::mutex&					GetRequestLogLock() { static std::mutex lock; return lock; }
+static std::vector<std::string>&	GetRequestLog() { static std::vector<std::string> log; return log; }
+
+class StandinEndpoint
+{
+	private:
+		std::string			name;
+		standin_handler_t	handler;
+		std::atomic<int>	delayms;
+		S3fsStandinEndpoint	endpoint;
+
+	private:
+		void HandleRequest(const S3FSSTANDINREQ& req, S3FSSTANDINRES& res);
+
+	public:
+		StandinEndpoint(const char* endpointname, const standin_handler_t& endpointhandler) : name(endpointname), handler(endpointhandler), delayms(0), endpoint(std::bind(&StandinEndpoint::HandleRequest, this, std::placeholders::_1, std::placeholders::_2)) {}
+
+		bool Start() { return endpoint.Start(); }
+		void Stop() { endpoint.Stop(); }
+
+		int GetPort() const { return endpoint.GetPort(); }
+		std::string GetUrl() const { return endpoint.GetUrl(); }
+		void SetDelay(int ms) { delayms.store(ms); }
+};
+
+void StandinEndpoint::HandleRequest(const S3FSSTANDINREQ& req, S3FSSTANDINRES& res)
+{
+	{
+		std::lock_guard<std::mutex>	guard(GetRequestLogLock());
+		GetRequestLog().push_back(name + " : " + req.method + " " + req.path);
+	}
+
+	int	delay = delayms.load();
+	if(0 < delay){
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+	}
+	handler(req, name, res);
+}
+
+static void PrintRequestLog()
+{
+	std::lock_guard<std::mutex>	guard(GetRequestLogLock());
+	std::vector<std::string>&	log = GetRequestLog();
+
+	if(log.empty()){
+		std::cout << "     (no request)" << std::endl;
+	}
+	for(std::vector<std::string>::const_iterator iter = log.begin(); iter != log.end(); ++iter){
+		std::cout << "     " << *iter << std::endl;
+	}
+	log.clear();
+}
+
+//-------------------------------------------------------------------
+// Environments
+//-------------------------------------------------------------------
+// [NOTE]
+// Only the stand-in endpoints must be used, so the other credentials
+// (environments, ~/.aws, EC2 metadata) are disabled. The home directory
+// is the temporary directory for the SSO token cache file.
+//
+static bool SetupEnvironments(const std::string& tmpdir)
+{
+	S3fsStandinResetEnvironments(tmpdir + "/.aws");
+	setenv("HOME", tmpdir.c_str(), 1);
+
+	return (0 == mkdir((tmpdir + "/.aws").c_str(), 0700) && WriteFile(tmpdir + "/.aws/credentials", "", 0600) && WriteFile(tmpdir + "/.aws/config", "[default]\n", 0600));
+}
+
+//-------------------------------------------------------------------
+// Calling functions
+//-------------------------------------------------------------------
+static bool CallInit(const char* section, const std::string& options)
+{
+	char*	perrstr = NULL;
+
+	std::cout << "  [" << section << "] InitS3fsCredential" << std::endl;
+	if(!InitS3fsCredential(options.c_str(), &perrstr)){
+		std::cout << "     [Failed] " << (perrstr ? perrstr : "unknown") << std::endl;
+		free(perrstr);
+		return false;
+	}
+	std::cout << "     [Succeed]" << std::endl;
+	std::cout << std::endl;
+	return true;
+}
+
+static bool CallFree(const char* section)
+{
+	char*	perrstr = NULL;
+
+	std::cout << "  [" << section << "] FreeS3fsCredential" << std::endl;
+	if(!FreeS3fsCredential(&perrstr)){
+		std::cout << "     [Failed] " << (perrstr ? perrstr : "unknown") << std::endl;
+		free(perrstr);
+		return false;
+	}
+	std::cout << "     [Succeed]" << std::endl;
+	std::cout << std::endl;
+	return true;
+}
+
+static bool CallUpdate(const char* section, const char* title)
+{
+	char*		paccess_key_id		= NULL;
+	char*		pserect_access_key	= NULL;
+	char*		paccess_token		= NULL;
+	long long	token_expire		= 0;
+	char*		perrstr				= NULL;
+
+	std::cout << "  [" << section << "] UpdateS3fsCredential - " << title << std::endl;
+	bool	result = UpdateS3fsCredential(&paccess_key_id, &pserect_access_key, &paccess_token, &token_expire, &perrstr);
+	if(result){
+		std::cout << "     [Succeed] Credential = {"									<< std::endl;
+		std::cout << "                 AWS Access Key Id    = " << paccess_key_id		<< std::endl;
+		std::cout << "                 AWS Secret Key       = " << pserect_access_key	<< std::endl;
+		std::cout << "                 AWS Session Token    = " << paccess_token		<< std::endl;
+		std::cout << "               }"													<< std::endl;
+	}else{
+		std::cout << "     [Failed] " << (perrstr ? perrstr : "unknown") << std::endl;
+	}
+	std::cout << std::endl;
+
+	free(paccess_key_id);
+	free(pserect_access_key);
+	free(paccess_token);
+	free(perrstr);
+	return result;
+}
+
+//-------------------------------------------------------------------
+// Test : Invalid options
+//-------------------------------------------------------------------
+// [NOTE]
+// The invalid numeric values must be an error of InitS3fsCredential,
+// not an exception.
+//
+static bool TestInvalidOptions()
+{
+	const char*	section		= "Options";
+	const char*	options[]	= {
+		"Off,TokenPeriodSecond=abc",
+		"Off,MinValidSecond=60s",
+		"Off,RefreshJitterSecond=99999999999999999999",
+		"Off,DeadlineMs=0x10"
+	};
+	bool		result		= true;
+
+	for(size_t cnt = 0; cnt < sizeof(options) / sizeof(options[0]); ++cnt){
+		char*	perrstr = NULL;
+
+		std::cout << "  [" << section << "] InitS3fsCredential - \"" << options[cnt] << "\"" << std::endl;
+		if(InitS3fsCredential(options[cnt], &perrstr)){
+			std::cout << "     [Failed] Succeeded with the invalid option." << std::endl;
+			FreeS3fsCredential(NULL);
+			result = false;
+		}else{
+			std::cout << "     [Succeed] " << (perrstr ? perrstr : "unknown") << std::endl;
+		}
+		std::cout << std::endl;
+		free(perrstr);
+	}
+	return result;
+}
+
+//-------------------------------------------------------------------
+// Test : SSO
+//-------------------------------------------------------------------
+// [NOTE]
+// The access token in the cache file has expired, so the library must
+// refresh it with the refresh token(OIDC), write it back to the cache
+// file, and get the role credentials(portal) with the new token. The
+// second call must use the cached role credentials without requests.
+//
+// The cache file name is the SHA1 of the start url(legacy format).
+//
+static const char	SSO_START_URL[]			= "https://s3fsawscred-test.awsapps.com/start";
+static const char	SSO_CACHE_FILE_NAME[]	= "fbec7b9f6e3318eb95a7dfc402e201f41d75aac5.json";
+static const char	SSO_ACCOUNT_ID[]		= "123456789012";
+static const char	SSO_ROLE_NAME[]			= "s3fsawscred-test";
+
+static void SSOHandler(const S3FSSTANDINREQ& req, const std::string& name, S3FSSTANDINRES& res)
+{
+	if("oidc" == name && "POST" == req.method && "/token" == req.path){
+		if(std::string::npos == req.body.find("\"test-refresh-token-1\"") || std::string::npos == req.body.find("\"test-client-secret\"")){
+			res.status	= 400;
+			res.body	= "{\"error\":\"invalid_grant\"}";
+			return;
+		}
+		res.status	= 200;
+		res.body	= "{\"accessToken\":\"test-access-token-2\",\"expiresIn\":3600,\"refreshToken\":\"test-refresh-token-2\",\"tokenType\":\"Bearer\"}";
+
+	}else if("portal" == name && "GET" == req.method && "/federation/credentials" == req.path){
+		if("test-access-token-2" != req.GetHeader("x-amz-sso_bearer_token") || std::string::npos == req.query.find(std::string("account_id=") + SSO_ACCOUNT_ID) || std::string::npos == req.query.find(std::string("role_name=") + SSO_ROLE_NAME)){
+			res.status	= 401;
+			res.body	= "{\"message\":\"Session token not found or invalid\"}";
+			return;
+		}
+		std::ostringstream	body;
+		body << "{\"roleCredentials\":{\"accessKeyId\":\"ASIASSOSTANDIN\",\"secretAccessKey\":\"sso-standin-secret\",\"sessionToken\":\"sso-standin-session-token\",\"expiration\":" << ((static_cast<long long>(time(NULL)) + 3600) * 1000) << "}}";
+		res.status	= 200;
+		res.body	= body.str();
+	}
+}
+
+static bool TestSSO(const std::string& tmpdir)
+{
+	const char*	section		= "SSO";
+	std::string	cachedir	= tmpdir + "/.aws/sso/cache";
+	std::string	cachefile	= cachedir + "/" + SSO_CACHE_FILE_NAME;
+
+	// Profile and token cache file
+	std::ostringstream	config;
+	config << "[default]\n";
+	config << "[profile s3fstest]\n";
+	config << "sso_start_url = " << SSO_START_URL << "\n";
+	config << "sso_region = us-east-1\n";
+	config << "sso_account_id = " << SSO_ACCOUNT_ID << "\n";
+	config << "sso_role_name = " << SSO_ROLE_NAME << "\n";
+
+	std::ostringstream	cache;
+	cache << "{\"startUrl\":\"" << SSO_START_URL << "\",\"region\":\"us-east-1\",\"accessToken\":\"test-access-token-1\",\"expiresAt\":\"" << S3fsStandinFormatIso8601(time(NULL) - 60) << "\",";
+	cache << "\"refreshToken\":\"test-refresh-token-1\",\"clientId\":\"test-client-id\",\"clientSecret\":\"test-client-secret\",\"registrationExpiresAt\":\"" << S3fsStandinFormatIso8601(time(NULL) + 86400) << "\"}";
+
+	if(0 != mkdir((tmpdir + "/.aws/sso").c_str(), 0700) || 0 != mkdir(cachedir.c_str(), 0700) || !WriteFile(tmpdir + "/.aws/config", config.str(), 0600) || !WriteFile(cachefile, cache.str(), 0600)){
+		std::cerr << "[ERROR] Could not create SSO profile and token cache file." << std::endl;
+		return false;
+	}
+
+	StandinEndpoint	oidc("oidc", SSOHandler);
+	StandinEndpoint	portal("portal", SSOHandler);
+	if(!oidc.Start() || !portal.Start()){
+		return false;
+	}
+	std::string	options = "Off,SSOProfile=s3fstest,SSOPortalEndpoint=" + portal.GetUrl() + ",SSOOIDCEndpoint=" + oidc.GetUrl();
+
+	if(!CallInit(section, options)){
+		return false;
+	}
+	bool	result = true;
+	result = CallUpdate(section, "refresh access token and get role credentials") && result;
+	result = CallUpdate(section, "cached role credentials") && result;
+
+	std::cout << "  [" << section << "] Requests to stand-ins" << std::endl;
+	PrintRequestLog();
+	std::cout << std::endl;
+
+	// Token cache file must be written back with mode 0600, and no temporary file is left
+	struct stat	st;
+	std::string	cachejson = ReadFile(cachefile);
+	std::cout << "  [" << section << "] Token cache file" << std::endl;
+	std::cout << "     Access Token  = " << GetJsonString(cachejson, "accessToken")		<< std::endl;
+	std::cout << "     Refresh Token = " << GetJsonString(cachejson, "refreshToken")	<< std::endl;
+	std::cout << "     Client Id     = " << GetJsonString(cachejson, "clientId")		<< std::endl;
+	if(0 == stat(cachefile.c_str(), &st)){
+		char	mode[8];
+		snprintf(mode, sizeof(mode), "%04o", static_cast<unsigned int>(st.st_mode & 07777));
+		std::cout << "     Mode          = " << mode << std::endl;
+	}else{
+		std::cout << "     Mode          = (not found)" << std::endl;
+	}
+	std::cout << "     Files         = " << CountFiles(cachedir) << std::endl;
+	std::cout << std::endl;
+
+	result = CallFree(section) && result;
+	return result;
+}
+
+//-------------------------------------------------------------------
+// Test : STS failover
+//-------------------------------------------------------------------
+// [NOTE]
+// The first STS endpoint always fails(HTTP 500) immediately, and the
+// second one is slow but returns short-lived credentials. The first
+// update tries them in the specified order. After the credentials
+// expired, the next update must try the slow endpoint first, because
+// the failing endpoint must not look fast.
+//
+static void STSHandler(const S3FSSTANDINREQ& req, const std::string& name, S3FSSTANDINRES& res)
+{
+	if("POST" != req.method || std::string::npos == req.body.find("Action=AssumeRoleWithWebIdentity") || std::string::npos == req.body.find("WebIdentityToken=standin-web-identity-token")){
+		res.status	= 400;
+		return;
+	}
+	if("sts-failing" == name){
+		res.status	= 500;
+		res.body	= "<ErrorResponse><Error><Code>InternalFailure</Code></Error></ErrorResponse>";
+		return;
+	}
+	std::ostringstream	body;
+	body << "<AssumeRoleWithWebIdentityResponse xmlns=\"https://sts.amazonaws.com/doc/2011-06-15/\"><AssumeRoleWithWebIdentityResult><Credentials>";
+	body << "<AccessKeyId>ASIASTSSLOW</AccessKeyId><SecretAccessKey>sts-standin-secret</SecretAccessKey><SessionToken>sts-standin-session-token</SessionToken>";
+	body << "<Expiration>" << S3fsStandinFormatIso8601(time(NULL) + 2) << "</Expiration>";
+	body << "</Credentials></AssumeRoleWithWebIdentityResult></AssumeRoleWithWebIdentityResponse>";
+	res.status		= 200;
+	res.contentType	= "text/xml";
+	res.body		= body.str();
+}
+
+static bool TestSTSFailover(const std::string& tmpdir)
+{
+	const char*	section		= "STS";
+	std::string	tokenfile	= tmpdir + "/web-identity-token";
+
+	if(!WriteFile(tokenfile, "standin-web-identity-token\n", 0600)){
+		std::cerr << "[ERROR] Could not create web identity token file." << std::endl;
+		return false;
+	}
+	StandinEndpoint	failing("sts-failing", STSHandler);
+	StandinEndpoint	slow("sts-slow", STSHandler);
+	if(!failing.Start() || !slow.Start()){
+		return false;
+	}
+	slow.SetDelay(300);
+
+	setenv("AWS_ROLE_ARN",					"arn:aws:iam::123456789012:role/s3fsawscred-standin",	1);
+	setenv("AWS_WEB_IDENTITY_TOKEN_FILE",	tokenfile.c_str(),										1);
+	setenv("AWS_ROLE_SESSION_NAME",			"s3fsawscred-standin",									1);
+
+	bool	result = CallInit(section, "Off,STSEndpoints=" + failing.GetUrl() + ";" + slow.GetUrl());
+	if(result){
+		result = CallUpdate(section, "first update") && result;
+		std::cout << "  [" << section << "] Requests to stand-ins(specified order)" << std::endl;
+		PrintRequestLog();
+		std::cout << std::endl;
+
+		// Wait for the credentials to expire
+		std::this_thread::sleep_for(std::chrono::milliseconds(3000));
+
+		result = CallUpdate(section, "after the credentials expired") && result;
+		std::cout << "  [" << section << "] Requests to stand-ins(the slow endpoint first)" << std::endl;
+		PrintRequestLog();
+		std::cout << std::endl;
+
+		result = CallFree(section) && result;
+	}
+	unsetenv("AWS_ROLE_ARN");
+	unsetenv("AWS_WEB_IDENTITY_TOKEN_FILE");
+	unsetenv("AWS_ROLE_SESSION_NAME");
+	return result;
+}
+
+//-------------------------------------------------------------------
+// Test : Deadline
+//-------------------------------------------------------------------
+// [NOTE]
+// The container credentials stand-in issues credentials which expire
+// within the refresh margin(5 minutes), so that the library tries to
+// refresh them at each call(after the minimum reload interval).
+// Then the stand-in is delayed longer than DeadlineMs, and some threads
+// call UpdateS3fsCredential at the same time. All of them must return
+// the last valid credentials within about DeadlineMs, including the
+// threads which waited for the update in progress.
+//
+static const int	DEADLINE_MS			= 1000;
+static const int	DEADLINE_SLACK_MS	= 700;
+static const int	DEADLINE_THREADS	= 3;
+
+typedef struct deadline_result{
+	bool		result;
+	std::string	accessKeyId;
+	long long	elapsedms;
+}DEADLINERESULT;
+
+static void DeadlineThreadProc(DEADLINERESULT* presult)
+{
+	char*		paccess_key_id		= NULL;
+	char*		pserect_access_key	= NULL;
+	char*		paccess_token		= NULL;
+	long long	token_expire		= 0;
+	char*		perrstr				= NULL;
+
+	std::chrono::steady_clock::time_point	start = std::chrono::steady_clock::now();
+	presult->result		= UpdateS3fsCredential(&paccess_key_id, &pserect_access_key, &paccess_token, &token_expire, &perrstr);
+	presult->elapsedms	= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	presult->accessKeyId= presult->result ? paccess_key_id : (perrstr ? perrstr : "unknown");
+
+	free(paccess_key_id);
+	free(pserect_access_key);
+	free(paccess_token);
+	free(perrstr);
+}
+
+static bool TestDeadline()
+{
+	const char*			section		= "Deadline";
+	std::atomic<int>	generation(1);
+
+	StandinEndpoint	container("container", [&generation](const S3FSSTANDINREQ& req, const std::string& name, S3FSSTANDINRES& res)
+	{
+		(void)name;
+		if("GET" != req.method || "/v1/credentials" != req.path){
+			return;
+		}
+		std::ostringstream	body;
+		body << "{\"AccessKeyId\":\"ASIACONTAINER" << generation.load() << "\",\"SecretAccessKey\":\"container-standin-secret\",\"Token\":\"container-standin-session-token\",\"Expiration\":\"" << S3fsStandinFormatIso8601(time(NULL) + 120) << "\"}";
+		res.status	= 200;
+		res.body	= body.str();
+	});
+	if(!container.Start()){
+		return false;
+	}
+	setenv("AWS_CONTAINER_CREDENTIALS_FULL_URI", (container.GetUrl() + "/v1/credentials").c_str(), 1);
+
+	if(!CallInit(section, "Off,DeadlineMs=" + std::to_string(DEADLINE_MS))){
+		unsetenv("AWS_CONTAINER_CREDENTIALS_FULL_URI");
+		return false;
+	}
+	bool	result = CallUpdate(section, "get container credentials");
+
+	// Wait for the minimum reload interval(10s) of the cached credentials, and delay the stand-in
+	std::this_thread::sleep_for(std::chrono::milliseconds(10500));
+	generation.store(2);
+	container.SetDelay(DEADLINE_MS * 3);
+
+	DEADLINERESULT				results[DEADLINE_THREADS];
+	std::vector<std::thread>	threads;
+	for(int cnt = 0; cnt < DEADLINE_THREADS; ++cnt){
+		threads.push_back(std::thread(DeadlineThreadProc, &results[cnt]));
+	}
+	for(std::vector<std::thread>::iterator iter = threads.begin(); iter != threads.end(); ++iter){
+		iter->join();
+	}
+	for(int cnt = 0; cnt < DEADLINE_THREADS; ++cnt){
+		std::cout << "  [" << section << "] UpdateS3fsCredential - delayed stand-in(thread " << cnt << ")" << std::endl;
+		if(results[cnt].result){
+			std::cout << "     [Succeed] AWS Access Key Id = " << results[cnt].accessKeyId << std::endl;
+		}else{
+			std::cout << "     [Failed] " << results[cnt].accessKeyId << std::endl;
+			result = false;
+		}
+		if(results[cnt].elapsedms <= (DEADLINE_MS + DEADLINE_SLACK_MS)){
+			std::cout << "     Elapsed = within the deadline" << std::endl;
+		}else{
+			std::cout << "     Elapsed = " << results[cnt].elapsedms << "ms(exceeded the deadline)" << std::endl;
+			result = false;
+		}
+		std::cout << std::endl;
+	}
+
+	std::cout << "  [" << section << "] Requests to stand-ins" << std::endl;
+	PrintRequestLog();
+	std::cout << std::endl;
+
+	result = CallFree(section) && result;
+	unsetenv("AWS_CONTAINER_CREDENTIALS_FULL_URI");
+	return result;
+}
+
+//-------------------------------------------------------------------
+// Test : Async
+//-------------------------------------------------------------------
+// [NOTE]
+// FreeS3fsCredential called from a callback(worker thread) must be an
+// error instead of joining the worker thread itself.
+// The callbacks canceled by FreeS3fsCredential retry the request, and
+// the retry must be rejected(no new worker thread is started while the
+// library is being uninitialized).
+//
+typedef struct async_test_state{
+	std::mutex					lock;
+	std::vector<std::string>	events;
+
+	void Add(const std::string& event)
+	{
+		std::lock_guard<std::mutex>	guard(lock);
+		events.push_back(event);
+	}
+}ASYNCTESTSTATE;
+
+static void AsyncFreeCallback(bool result, const char* paccess_key_id, const char* pserect_access_key, const char* paccess_token, long long token_expire, const char* perrstr, void* puserdata)
+{
+	(void)paccess_key_id;
+	(void)pserect_access_key;
+	(void)paccess_token;
+	(void)token_expire;
+	(void)perrstr;
+
+	ASYNCTESTSTATE*	pstate	= static_cast<ASYNCTESTSTATE*>(puserdata);
+	char*			pfreeerr= NULL;
+	bool			freeres	= FreeS3fsCredential(&pfreeerr);
+
+	pstate->Add(std::string("callback(") + (result ? "true" : "false") + ") : FreeS3fsCredential " + (freeres ? "succeeded" : "failed") + (pfreeerr ? (std::string(" - ") + pfreeerr) : std::string("")));
+	free(pfreeerr);
+}
+
+static void AsyncRetryCallback(bool result, const char* paccess_key_id, const char* pserect_access_key, const char* paccess_token, long long token_expire, const char* perrstr, void* puserdata)
+{
+	(void)pserect_access_key;
+	(void)paccess_token;
+	(void)token_expire;
+
+	ASYNCTESTSTATE*	pstate = static_cast<ASYNCTESTSTATE*>(puserdata);
+	if(result){
+		// Keep the worker thread busy, so that the other requests are pending
+		pstate->Add(std::string("callback(true) : ") + paccess_key_id);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+		return;
+	}
+	char*	ppostreq	= NULL;
+	bool	postres		= UpdateS3fsCredentialAsync(AsyncRetryCallback, puserdata, &ppostreq);
+	pstate->Add(std::string("callback(false) : ") + (perrstr ? perrstr : "unknown") + " : retry " + (postres ? "accepted" : "rejected"));
+	free(ppostreq);
+}
+
+static bool TestAsync()
+{
+	const char*		section = "Async";
+	ASYNCTESTSTATE	state;
+
+	StandinEndpoint	container("container", [](const S3FSSTANDINREQ& req, const std::string& name, S3FSSTANDINRES& res)
+	{
+		(void)name;
+		if("GET" != req.method || "/v1/credentials" != req.path){
+			return;
+		}
+		res.status	= 200;
+		res.body	= "{\"AccessKeyId\":\"ASIACONTAINERASYNC\",\"SecretAccessKey\":\"container-standin-secret\",\"Token\":\"container-standin-session-token\",\"Expiration\":\"" + S3fsStandinFormatIso8601(time(NULL) + 3600) + "\"}";
+	});
+	if(!container.Start()){
+		return false;
+	}
+	setenv("AWS_CONTAINER_CREDENTIALS_FULL_URI", (container.GetUrl() + "/v1/credentials").c_str(), 1);
+
+	bool	result = CallInit(section, "Off");
+	if(result){
+		// FreeS3fsCredential from the callback
+		std::cout << "  [" << section << "] FreeS3fsCredential from the callback" << std::endl;
+		if(!UpdateS3fsCredentialAsync(AsyncFreeCallback, &state, NULL)){
+			std::cout << "     [Failed] Could not post the request." << std::endl;
+			result = false;
+		}
+		for(int cnt = 0; cnt < 100; ++cnt){
+			{
+				std::lock_guard<std::mutex>	guard(state.lock);
+				if(!state.events.empty()){
+					break;
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		{
+			std::lock_guard<std::mutex>	guard(state.lock);
+			for(std::vector<std::string>::const_iterator iter = state.events.begin(); iter != state.events.end(); ++iter){
+				std::cout << "     " << *iter << std::endl;
+			}
+			state.events.clear();
+		}
+		std::cout << std::endl;
+
+		// Retry from the canceled callbacks
+		std::cout << "  [" << section << "] Retry from the canceled callbacks" << std::endl;
+		for(int cnt = 0; cnt < 3; ++cnt){
+			if(!UpdateS3fsCredentialAsync(AsyncRetryCallback, &state, NULL)){
+				std::cout << "     [Failed] Could not post the request." << std::endl;
+				result = false;
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+		char*	perrstr	= NULL;
+		bool	freeres	= FreeS3fsCredential(&perrstr);
+		{
+			std::lock_guard<std::mutex>	guard(state.lock);
+			for(std::vector<std::string>::const_iterator iter = state.events.begin(); iter != state.events.end(); ++iter){
+				std::cout << "     " << *iter << std::endl;
+			}
+		}
+		std::cout << "     FreeS3fsCredential " << (freeres ? "succeeded" : "failed") << std::endl;
+		free(perrstr);
+
+		// Requests are rejected until InitS3fsCredential
+		bool	postres = UpdateS3fsCredentialAsync(AsyncRetryCallback, &state, NULL);
+		std::cout << "     UpdateS3fsCredentialAsync after FreeS3fsCredential " << (postres ? "accepted" : "rejected") << std::endl;
+		std::cout << std::endl;
+		if(!freeres || postres){
+			result = false;
+		}
+	}
+	unsetenv("AWS_CONTAINER_CREDENTIALS_FULL_URI");
+
+	std::cout << "  [" << section << "] Requests to stand-ins" << std::endl;
+	PrintRequestLog();
+	std::cout << std::endl;
+
+	return result;
+}
+
+//-------------------------------------------------------------------
+// Main
+//-------------------------------------------------------------------
+int main(void)
+{
+	// Temporary directory for the home directory
+	char	tmpdirbuff[] = "/tmp/s3fsawscred_standin.XXXXXX";
+	if(!mkdtemp(tmpdirbuff)){
+		std::cerr << "[ERROR] Could not create temporary directory : errno=" << errno << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::string	tmpdir = tmpdirbuff;
+	if(!SetupEnvironments(tmpdir)){
+		std::cerr << "[ERROR] Could not setup environments in " << tmpdir << std::endl;
+		RemoveDirectory(tmpdir);
+		exit(EXIT_FAILURE);
+	}
+
+	std::cout << "[awscred_standin_test] Start test for s3fsawscred.so with local stand-ins" << std::endl;
+	std::cout << std::endl;
+
+	bool	result = true;
+	result = TestInvalidOptions() && result;
+	result = TestSSO(tmpdir) && result;
+	result = TestSTSFailover(tmpdir) && result;
+	result = TestDeadline() && result;
+	result = TestAsync() && result;
+
+	RemoveDirectory(tmpdir);
+
+	if(!result){
+		std::cout << "[awscred_standin_test] FAILED" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::cout << "[awscred_standin_test] PASSED" << std::endl;
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noexpandtab sw=4 ts=4 fdm=marker
+ * vim<600: noexpandtab sw=4 ts=4
+ */
@@ -18,9 +18,44 @@
 
 #include <time.h>
 #include <iostream>
+#include <string>
+#include <mutex>
+#include <condition_variable>
 
 #include "awscred_func.h"
 
+//
+// For UpdateS3fsCredentialAsync
+//
+typedef struct async_result{
+	std::mutex				lock;
+	std::condition_variable	cond;
+	bool					done;
+	bool					result;
+	std::string				access_key_id;
+	std::string				serect_access_key;
+	std::string				access_token;
+	long long				token_expire;
+	std::string				errstr;
+
+	async_result() : done(false), result(false), token_expire(0) {}
+}ASYNCRESULT;
+
+static void AsyncCallback(bool result, const char* paccess_key_id, const char* pserect_access_key, const char* paccess_token, long long token_expire, const char* perrstr, void* puserdata)
+{
+	ASYNCRESULT*				pResult = static_cast<ASYNCRESULT*>(puserdata);
+	std::lock_guard<std::mutex>	guard(pResult->lock);
+
+	pResult->result				= result;
+	pResult->access_key_id		= paccess_key_id		? paccess_key_id		: "";
+	pResult->serect_access_key	= pserect_access_key	? pserect_access_key	: "";
+	pResult->access_token		= paccess_token			? paccess_token			: "";
+	pResult->token_expire		= token_expire;
+	pResult->errstr				= perrstr				? perrstr				: "";
+	pResult->done				= true;
+	pResult->cond.notify_all();
+}
+
 int main(int argc, char** argv)
 {
 	char*	perrstr = NULL;
@@ -28,6 +63,27 @@ int main(int argc, char** argv)
 	std::cout << "[awscred_test] Start test for s3fsawscred.so" << std::endl;
 	std::cout << std::endl;
 
+	//
+	// Test : UpdateS3fsCredentialAsync before InitS3fsCredential
+	//
+	// [NOTE]
+	// The request must be rejected without starting the worker thread,
+	// because aws-sdk-cpp is not initialized yet.
+	//
+	ASYNCRESULT	earlyResult;
+
+	std::cout << "  [Function] UpdateS3fsCredentialAsync - before InitS3fsCredential" << std::endl;
+	if(UpdateS3fsCredentialAsync(AsyncCallback, &earlyResult, &perrstr)){
+		std::cerr << "     [ERROR] The request was accepted before InitS3fsCredential." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::cout << "     [Succeed] Rejected : " << (perrstr ? perrstr : "unknown") << std::endl;
+	std::cout << std::endl;
+	if(perrstr){
+		free(perrstr);
+		perrstr = NULL;
+	}
+
 	//
 	// Test : InitS3fsCredential
 	//
@@ -100,6 +156,64 @@ int main(int argc, char** argv)
 	std::cout << "               }"													<< std::endl;
 	std::cout << std::endl;
 
+	//
+	// Test : UpdateS3fsCredentialAsync
+	//
+	ASYNCRESULT	asyncResult;
+
+	std::cout << "  [Function] UpdateS3fsCredentialAsync" << std::endl;
+	if(!UpdateS3fsCredentialAsync(AsyncCallback, &asyncResult, &perrstr)){
+		std::cerr << "     [ERROR] Could not request Credential for AWS : " << (perrstr ? perrstr : "unknown") << std::endl;
+		if(perrstr){
+			free(perrstr);
+		}
+		FreeS3fsCredential(&perrstr);
+		if(perrstr){
+			free(perrstr);
+		}
+		exit(EXIT_FAILURE);
+	}
+	{
+		std::unique_lock<std::mutex>	guard(asyncResult.lock);
+		asyncResult.cond.wait(guard, [&asyncResult]{ return asyncResult.done; });
+	}
+	if(!asyncResult.result){
+		std::cerr << "     [ERROR] Could not get Credential for AWS asynchronously : " << asyncResult.errstr << std::endl;
+		FreeS3fsCredential(&perrstr);
+		if(perrstr){
+			free(perrstr);
+		}
+		exit(EXIT_FAILURE);
+	}
+	std::cout << "     [Succeed] Credential = {"												<< std::endl;
+	std::cout << "                 AWS Access Key Id    = " << asyncResult.access_key_id		<< std::endl;
+	std::cout << "                 AWS Secret Key       = " << asyncResult.serect_access_key	<< std::endl;
+	std::cout << "                 AWS Session Token    = " << asyncResult.access_token		<< std::endl;
+	std::cout << "                 Expiration(unixtime) = " << asyncResult.token_expire		<< std::endl;
+	std::cout << "               }"																<< std::endl;
+	std::cout << std::endl;
+
+	//
+	// Test : ProbeS3fsCredential
+	//
+	unsigned long long	generation	= 0;
+	long long			expire_left	= 0;
+
+	std::cout << "  [Function] ProbeS3fsCredential" << std::endl;
+	if(!ProbeS3fsCredential(&generation, &expire_left)){
+		std::cerr << "     [ERROR] Could not probe Credential for AWS." << std::endl;
+		FreeS3fsCredential(&perrstr);
+		if(perrstr){
+			free(perrstr);
+		}
+		exit(EXIT_FAILURE);
+	}
+	std::cout << "     [Succeed] Credential = {"								<< std::endl;
+	std::cout << "                 Generation           = " << generation	<< std::endl;
+	std::cout << "                 Expiration left(sec) = " << expire_left	<< std::endl;
+	std::cout << "               }"												<< std::endl;
+	std::cout << std::endl;
+
 	//
 	// Test : FreeS3fsCredential
 	//